@@ -0,0 +1,137 @@
+#include "doc.h"
+#include "search.h"
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <atomic>
+#include <new>
+
+using namespace std;
+
+// Allocation counting benchmark for Doc storage. Compares bulk load, copy,
+// edit and destruction of a large document against storing one vector of
+// code points per line. Then times each search mode against comparing code
+// points at every offset.
+
+static atomic<size_t> allocations = 0;
+
+// gcc cannot see that the replaced operators pair malloc with free
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t size) {
+	allocations++;
+	if (void* p = malloc(size ? size: 1)) return p;
+	throw bad_alloc();
+}
+
+void* operator new(size_t size, align_val_t align) {
+	allocations++;
+	if (void* p = aligned_alloc((size_t)align, (size+(size_t)align-1)/(size_t)align*(size_t)align)) return p;
+	throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+void operator delete(void* p, align_val_t) noexcept {
+	free(p);
+}
+
+void operator delete(void* p, size_t, align_val_t) noexcept {
+	free(p);
+}
+
+template <typename F>
+static void measure(const char* what, F fn) {
+	size_t before = allocations;
+	auto start = chrono::steady_clock::now();
+	fn();
+	auto ms = chrono::duration<double,milli>(chrono::steady_clock::now()-start).count();
+	printf("  %-10s %10zu allocations %10.2f ms\n", what, allocations-before, ms);
+}
+
+int main(int argc, char* argv[]) {
+	size_t lines = argc > 1 ? atol(argv[1]): 1000000;
+
+	string text;
+	for (size_t i = 0; i < lines; i++) {
+		text += "\tline " + to_string(i) + " of the benchmark document\n";
+	}
+
+	printf("%zu lines, %zu bytes\n", lines, text.size());
+
+	printf("vector per line\n");
+	{
+		auto* doc = new vector<vector<uint32_t>>;
+		auto* copy = new vector<vector<uint32_t>>;
+		measure("load", [&]() {
+			doc->emplace_back();
+			for (auto c: text) {
+				doc->back().push_back(c);
+				if (c == '\n') doc->emplace_back();
+			}
+		});
+		measure("copy", [&]() { *copy = *doc; });
+		measure("edit", [&]() {
+			for (size_t i = 0; i < 1000; i++) {
+				auto& line = (*copy)[i*7919%copy->size()];
+				line.insert(line.begin(), 'x');
+			}
+		});
+		measure("destroy", [&]() { delete doc; delete copy; });
+	}
+
+	printf("doc\n");
+	{
+		auto* doc = new Doc;
+		auto* copy = new Doc;
+		measure("load", [&]() { doc->push_back(text); });
+		measure("copy", [&]() { *copy = *doc; });
+		measure("edit", [&]() {
+			for (size_t i = 0; i < 1000; i++) {
+				copy->insert(copy->begin()+i*7919%copy->size(), 'x');
+			}
+		});
+		measure("destroy", [&]() { delete doc; delete copy; });
+	}
+
+	printf("search\n");
+	{
+		Doc doc;
+		doc.push_back(text);
+		// fragment the pieces the way editing does
+		for (size_t i = 0; i < 1000; i++) {
+			doc.insert(doc.begin()+i*7919%doc.size(), 'x');
+		}
+
+		size_t matches = 0;
+		auto run = [&](const char* what, const Search& search) {
+			measure(what, [&]() { matches = search.all(doc).size(); });
+			printf("  %-10s %10zu matches\n", "", matches);
+		};
+
+		auto needle = UTF8("benchmark document").codes;
+		measure("naive", [&]() {
+			matches = 0;
+			for (uint i = 0; i+needle.size() <= doc.size(); i++) {
+				uint j = 0;
+				while (j < needle.size() && doc[i+j] == needle[j]) j++;
+				matches += j == needle.size();
+			}
+		});
+		printf("  %-10s %10zu matches\n", "", matches);
+
+		run("literal", Search("benchmark document"));
+		run("short", Search("99"));
+		run("folded", Search("BENCHMARK DOCUMENT", true));
+		run("words", Search("line", false, true));
+		run("regex", Search("line [0-9]*7 ", false, false, true));
+	}
+
+	return 0;
+}
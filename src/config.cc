@@ -33,6 +33,12 @@ void Config::defaults() {
 	font.mono.size = font.prop.size;
 
 	view.font = ini.getDouble("edit", "font", 1.0);
+	view.large = ini.getInteger("edit", "large", 64) << 20;
+	view.rescan = std::chrono::seconds(ini.getInteger("edit", "rescan", 30));
+	view.fsync = ini.getString("edit", "fsync", "on") == "on";
+	view.undo = (size_t)ini.getInteger("edit", "undo", 64) << 20;
+	view.undoTotal = (size_t)ini.getInteger("edit", "undo.total", 512) << 20;
+	view.journal = tilde(ini.getString("edit", "undo.journal", "~/.sce-undo"));
 	sidebar.font = ini.getDouble("sidebar", "font", 1.0);
 	popup.font = ini.getDouble("popup", "font", 1.0);
 
@@ -36,6 +36,12 @@ struct Config {
 
 	struct {
 		float font = 1.0f;
+		size_t large = 64<<20;
+		std::chrono::seconds rescan = std::chrono::seconds(30);
+		bool fsync = true;
+		size_t undo = 64<<20;
+		size_t undoTotal = 512<<20;
+		std::string journal;
 	} view;
 
 	struct {
@@ -0,0 +1,1027 @@
+#include "doc.h"
+#include <functional>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <climits>
+#include <cerrno>
+#include <atomic>
+
+using namespace std;
+
+// Content hashes are polynomials in the bytes modulo the Mersenne prime
+// 2^61-1, counting bytes from 1 so leading zeros still change them. The
+// hash of two runs joined is hash(a)*base^bytes(b) + hash(b), so nodes
+// combine their subtrees without revisiting the text.
+static const uint64_t hashPrime = (1ull<<61)-1;
+static const uint64_t hashBase = 0x100000001b3ull;
+
+static uint64_t hashReduce(__uint128_t x) {
+	uint64_t r = (uint64_t)(x & hashPrime) + (uint64_t)(x >> 61);
+	r = (r & hashPrime) + (r >> 61);
+	return r >= hashPrime ? r-hashPrime: r;
+}
+
+static uint64_t hashMul(uint64_t a, uint64_t b) {
+	return hashReduce((__uint128_t)a*b);
+}
+
+// base^n
+static uint64_t hashPow(uint64_t n, uint64_t base = hashBase) {
+	uint64_t r = 1;
+	for (uint64_t b = base; n; n >>= 1, b = hashMul(b, b)) {
+		if (n & 1) r = hashMul(r, b);
+	}
+	return r;
+}
+
+// Extend h by length bytes. Four at a time the products are independent,
+// which keeps bulk loads from waiting on one multiply after another.
+static uint64_t hashBytes(uint64_t h, const char* bytes, size_t length) {
+	static const uint64_t b2 = hashPow(2);
+	static const uint64_t b3 = hashPow(3);
+	static const uint64_t b4 = hashPow(4);
+	auto c = [&](size_t i) { return (uint64_t)(uint8_t)bytes[i] + 1; };
+	size_t i = 0;
+	for (; i+4 <= length; i += 4) {
+		__uint128_t x = (__uint128_t)h*b4;
+		x += (__uint128_t)c(i)*b3 + (__uint128_t)c(i+1)*b2 + (__uint128_t)c(i+2)*hashBase + c(i+3);
+		h = hashReduce(x);
+	}
+	for (; i < length; i++) h = hashReduce((__uint128_t)h*hashBase + c(i));
+	return h;
+}
+
+// The hash of the first bytes of a run, or of the rest, given the hash of
+// the whole run and of the other part. Splits hash only the shorter side.
+static uint64_t hashHead(uint64_t whole, uint64_t tail, size_t tailBytes) {
+	static const uint64_t inverse = hashPow(hashPrime-2);
+	uint64_t rest = whole >= tail ? whole-tail: whole+hashPrime-tail;
+	return hashMul(rest, hashPow(tailBytes, inverse));
+}
+
+static uint64_t hashTail(uint64_t whole, uint64_t head, size_t tailBytes) {
+	uint64_t shifted = hashMul(head, hashPow(tailBytes));
+	return whole >= shifted ? whole-shifted: whole+hashPrime-shifted;
+}
+
+uint64_t Doc::hash(const char* bytes, size_t length) {
+	return hashBytes(0, bytes, length);
+}
+
+// Nodes for a run of pieces are carved from one slab by build(). Each node
+// still has its own control block and may be released on any thread; the
+// slab goes when its last node does. Single nodes made by edits come from
+// make_shared in leaf(), as a slab of one would only add an allocation.
+struct Slab {
+	size_t capacity = 0;
+	size_t used = 0;
+	atomic<size_t> live = 0;
+	char* storage = nullptr;
+};
+
+template <typename T>
+struct SlabAllocator {
+	typedef T value_type;
+	Slab* slab = nullptr;
+
+	SlabAllocator(Slab* s) : slab(s) {}
+
+	template <typename U>
+	SlabAllocator(const SlabAllocator<U>& other) : slab(other.slab) {}
+
+	T* allocate(size_t n) {
+		ensure(n == 1 && slab->used < slab->capacity);
+		if (!slab->storage) slab->storage = (char*)::operator new(slab->capacity*sizeof(T), align_val_t(alignof(T)));
+		slab->live++;
+		return (T*)slab->storage + slab->used++;
+	}
+
+	void deallocate(T*, size_t) {
+		if (--slab->live) return;
+		::operator delete(slab->storage, align_val_t(alignof(T)));
+		delete slab;
+	}
+
+	template <typename U>
+	bool operator==(const SlabAllocator<U>& other) const {
+		return slab == other.slab;
+	}
+};
+
+Doc::Doc(initializer_list<uint32_t> l) {
+	for (auto v: l) push_back(v);
+}
+
+Doc::Doc(const Doc& other) {
+	operator=(other);
+	version = other.version;
+	journal.clear();
+}
+
+// assignment is an edit replacing the whole document
+Doc& Doc::operator=(const Doc& other) {
+	if (this == &other) return *this;
+	uint before = size();
+	original = other.original;
+	added = other.added;
+	mapping = other.mapping;
+	root = other.root;
+	// both sides may append to the shared last block, so leave it to other
+	tail = added ? added->size()*addBlock: 0;
+	near = {};
+	record(0, before, size());
+	return *this;
+}
+
+Doc& Doc::operator=(Doc&& other) {
+	if (this == &other) return *this;
+	uint before = size();
+	original = move(other.original);
+	added = move(other.added);
+	tail = other.tail;
+	mapping = move(other.mapping);
+	root = move(other.root);
+	near = {};
+	record(0, before, size());
+	return *this;
+}
+
+bool Doc::operator==(const Doc& other) const {
+	if (size() != other.size() || hash() != other.hash()) return false;
+	return extract((size_t)0, size()) == other.extract((size_t)0, other.size());
+}
+
+bool Doc::sanity() const {
+	function<bool(const Node*)> check = [&](const Node* node) {
+		if (!node) return true;
+		auto& piece = node->piece;
+		if (!piece.length || piece.bytes > maxPiece) return false;
+		auto bytes = data(piece);
+		if (UTF8::continuation(bytes[0])) return false;
+		uint codes = 0;
+		for (uint i = 0; i < piece.bytes; i++) codes += !UTF8::continuation(bytes[i]);
+		if (codes != piece.length) return false;
+		if (piece.newlines != tally(piece, piece.length)) return false;
+		if (piece.hash != hashBytes(0, bytes, piece.bytes)) return false;
+		uint cells = piece.length;
+		uint newlines = piece.newlines;
+		for (auto child: {node->left.get(), node->right.get()}) {
+			if (!child) continue;
+			if (child->priority > node->priority) return false;
+			if (!check(child)) return false;
+			cells += child->cells;
+			newlines += child->newlines;
+		}
+		return cells == node->cells && newlines == node->newlines;
+	};
+	string text = *this;
+	return check(root.get()) && hash() == hash(text.data(), text.size());
+}
+
+void Doc::clear() {
+	record(0, size(), 0);
+	original.reset();
+	added.reset();
+	tail = 0;
+	mapping.reset();
+	root.reset();
+	near = {};
+}
+
+void Doc::record(uint offset, uint removed, uint inserted) {
+	if (!removed && !inserted) return;
+	version++;
+	journal.push_back({offset, removed, inserted});
+	if (journal.size() > journalLimit) journal.pop_front();
+}
+
+vector<Doc::Change> Doc::changes(uint64_t since) const {
+	if (!recent(since)) return {};
+	return {journal.end()-(version-since), journal.end()};
+}
+
+void Doc::fold(vector<Region>& regions, const Change& change) {
+	uint start = change.offset;
+	uint end = change.offset+change.removed;
+
+	auto lo = lower_bound(regions.begin(), regions.end(), start, [](auto& region, uint start) {
+		return region.offset+region.length < start;
+	});
+
+	Region merged = {start, 0, 0};
+	uint covered = 0;
+	uint removed = 0;
+
+	auto hi = lo;
+	for (; hi != regions.end() && hi->offset <= end; ++hi) {
+		merged.offset = min(merged.offset, hi->offset);
+		end = max(end, hi->offset+hi->length);
+		covered += hi->length;
+		removed += hi->removed;
+	}
+
+	// text in the span outside the old regions was still as it was
+	merged.removed = end-merged.offset-covered+removed;
+	merged.length = end-merged.offset-change.removed+change.inserted;
+
+	for (auto it = hi; it != regions.end(); ++it) it->offset = it->offset-change.removed+change.inserted;
+	regions.insert(regions.erase(lo, hi), merged);
+}
+
+vector<Doc::Region> Doc::regions(uint64_t since) const {
+	vector<Region> regions;
+	for (auto& change: changes(since)) fold(regions, change);
+	return regions;
+}
+
+const char* Doc::data(const Piece& piece) const {
+	if (piece.add) return (*added)[piece.start/addBlock]->bytes + piece.start%addBlock;
+	return (mapping ? mapping->data: original->data()) + piece.start;
+}
+
+// byte offset of a cell within a piece
+uint Doc::offset(const Piece& piece, uint cell) const {
+	if (piece.ascii()) return cell;
+	auto bytes = data(piece);
+	uint byte = 0;
+	for (uint i = 0; i < cell; i++) byte += UTF8::width(bytes[byte]);
+	return byte;
+}
+
+// newlines in the first length cells of a piece
+uint Doc::tally(const Piece& piece, uint length) const {
+	auto bytes = data(piece);
+	return count(bytes, bytes+offset(piece, length), '\n');
+}
+
+// a piece over valid UTF-8 already stored at start in a buffer
+Doc::Piece Doc::chunk(const char* bytes, size_t start, uint length, bool add) const {
+	Piece piece = {add, start, length, 0, 0};
+	for (uint i = 0; i < length; i++) {
+		piece.length += !UTF8::continuation(bytes[i]);
+		piece.newlines += bytes[i] == '\n';
+	}
+	piece.hash = hashBytes(0, bytes, length);
+	return piece;
+}
+
+// True when nothing else holds p, so it may be changed in place. Snapshots
+// are dropped on worker threads, and use_count() is only a relaxed load: the
+// fence pairs with the release in the last other holder's decrement, so its
+// reads come before our writes. A count of one can't rise again, as no copy
+// is left to take another reference from. ThreadSanitizer doesn't model
+// fences, so there a copy's acq_rel increment does the same job.
+template<typename T>
+static bool sole(const shared_ptr<T>& p) {
+	if (p.use_count() > 1) return false;
+#ifdef __SANITIZE_THREAD__
+	shared_ptr<T> probe = p;
+#else
+	atomic_thread_fence(memory_order_acquire);
+#endif
+	return true;
+}
+
+// Copy bytes to the add buffer and return their offset. They start a new
+// block when they would not fit in the last one, so a piece never spans two.
+size_t Doc::append(const char* bytes, uint length) {
+	if (!added) added = make_shared<Blocks>();
+	if (tail+length > added->size()*addBlock) {
+		if (!sole(added)) added = make_shared<Blocks>(*added);
+		tail = added->size()*addBlock;
+		added->push_back(shared_ptr<Block>(new Block));
+	}
+	size_t start = tail;
+	memcpy((*added)[start/addBlock]->bytes + start%addBlock, bytes, length);
+	tail += length;
+	return start;
+}
+
+// xorshift32 priorities
+uint Doc::random() {
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+Doc::Tree Doc::leaf(const Piece& piece) {
+	auto node = make_shared<Node>();
+	node->piece = piece;
+	node->priority = random();
+	update(node.get());
+	return node;
+}
+
+void Doc::update(Node* node) {
+	node->cells = node->piece.length;
+	node->newlines = node->piece.newlines;
+	node->hash = node->piece.hash;
+	node->scale = hashPow(node->piece.bytes);
+	if (auto left = node->left.get()) {
+		node->cells += left->cells;
+		node->newlines += left->newlines;
+		node->hash = hashReduce((__uint128_t)left->hash*node->scale + node->hash);
+		node->scale = hashMul(left->scale, node->scale);
+	}
+	if (auto right = node->right.get()) {
+		node->cells += right->cells;
+		node->newlines += right->newlines;
+		node->hash = hashReduce((__uint128_t)node->hash*right->scale + right->hash);
+		node->scale = hashMul(node->scale, right->scale);
+	}
+}
+
+// a node shared with a copy is copied before it is changed
+Doc::Node* Doc::own(Tree& node) {
+	if (!sole(node)) node = make_shared<Node>(*node);
+	return node.get();
+}
+
+// The first index cells go left and the rest right. A piece straddling the
+// boundary is cut in two, the tail a new node with its own priority that
+// rises past any ancestor it outranks on the way back up.
+pair<Doc::Tree,Doc::Tree> Doc::split(Tree node, uint index) {
+	if (!node) return {nullptr, nullptr};
+	own(node);
+
+	uint left = node->left ? node->left->cells: 0;
+
+	if (index <= left) {
+		auto [a, b] = split(move(node->left), index);
+		if (b && b->priority > node->priority) {
+			update(node.get());
+			return {move(a), merge(move(b), move(node))};
+		}
+		node->left = move(b);
+		update(node.get());
+		return {move(a), move(node)};
+	}
+
+	index -= left;
+
+	if (index >= node->piece.length) {
+		auto [a, b] = split(move(node->right), index-node->piece.length);
+		node->right = move(a);
+		update(node.get());
+		return {move(node), move(b)};
+	}
+
+	// only the shorter side is scanned, the other follows from the whole
+	Piece tail = node->piece;
+	uint byte = offset(tail, index);
+	auto bytes = data(tail);
+	node->piece.bytes = byte;
+	node->piece.length = index;
+	tail.start += byte;
+	tail.bytes -= byte;
+	tail.length -= index;
+	if (byte <= tail.bytes) {
+		node->piece.newlines = count(bytes, bytes+byte, '\n');
+		node->piece.hash = hashBytes(0, bytes, byte);
+		tail.newlines -= node->piece.newlines;
+		tail.hash = hashTail(tail.hash, node->piece.hash, tail.bytes);
+	}
+	else {
+		tail.newlines = count(bytes+byte, bytes+byte+tail.bytes, '\n');
+		tail.hash = hashBytes(0, bytes+byte, tail.bytes);
+		node->piece.newlines -= tail.newlines;
+		node->piece.hash = hashHead(node->piece.hash, tail.hash, tail.bytes);
+	}
+
+	// inheriting this node's priority instead would chain the pieces of
+	// repeated splits into a list
+	auto rest = leaf(tail);
+	auto right = merge(move(rest), move(node->right));
+	update(node.get());
+	return {move(node), move(right)};
+}
+
+Doc::Tree Doc::merge(Tree a, Tree b) {
+	if (!a) return b;
+	if (!b) return a;
+
+	if (a->priority > b->priority) {
+		own(a);
+		a->right = merge(move(a->right), move(b));
+		update(a.get());
+		return a;
+	}
+
+	own(b);
+	b->left = merge(move(a), move(b->left));
+	update(b.get());
+	return b;
+}
+
+// Append v to the piece ending at index, provided that piece is also the
+// tail of the add buffer with room in its block. Keeps typing from creating
+// a piece per keystroke.
+bool Doc::extend(uint index, uint32_t v) {
+	if (!index || !added) return false;
+
+	auto span = locate(index-1);
+	// whatever happens next may copy the located node away from this tree
+	near = {};
+
+	auto& piece = span.node->piece;
+	char bytes[4];
+	uint n = UTF8::encode(v, bytes);
+
+	if (!piece.add || span.index+piece.length != index) return false;
+	if (piece.start+piece.bytes != tail || piece.bytes+n > maxPiece) return false;
+	if (tail+n > added->size()*addBlock) return false;
+
+	append(bytes, n);
+	grow(root, index-1, bytes, n, v == '\n');
+	return true;
+}
+
+// lengthen the piece holding index, copying shared nodes on the way down
+void Doc::grow(Tree& node, uint index, const char* bytes, uint length, bool newline) {
+	auto n = own(node);
+	uint left = n->left ? n->left->cells: 0;
+
+	if (index < left) {
+		grow(n->left, index, bytes, length, newline);
+	}
+	else
+	if (index < left+n->piece.length) {
+		n->piece.bytes += length;
+		n->piece.length++;
+		n->piece.newlines += newline;
+		n->piece.hash = hashBytes(n->piece.hash, bytes, length);
+	}
+	else {
+		grow(n->right, index-left-n->piece.length, bytes, length, newline);
+	}
+
+	update(n);
+}
+
+Doc::Span Doc::locate(uint index) const {
+	ensure(index < size());
+
+	if (near.node && index >= near.index && index < near.index+near.node->piece.length) {
+		return near;
+	}
+
+	const Node* node = root.get();
+	uint base = 0;
+	uint line = 0;
+
+	while (node) {
+		auto left = node->left.get();
+		if (left && index < base+left->cells) {
+			node = left;
+			continue;
+		}
+		if (left) {
+			base += left->cells;
+			line += left->newlines;
+		}
+		if (index < base+node->piece.length) {
+			near = {node, base, line};
+			return near;
+		}
+		base += node->piece.length;
+		line += node->piece.newlines;
+		node = node->right.get();
+	}
+
+	ensure(false);
+	return {};
+}
+
+Doc::Cursor Doc::cursor(uint index) const {
+	ensure(index <= size());
+	if (!index) return {0,0,0};
+
+	Cursor cur = {index, root->newlines, 0};
+
+	if (index < size()) {
+		auto span = locate(index);
+		cur.line = span.line + tally(span.node->piece, index-span.index);
+	}
+
+	cur.cell = index - line_offset(cur.line);
+	return cur;
+}
+
+uint Doc::line_offset(uint line) const {
+	ensure(line < line_count());
+	if (!line) return 0;
+
+	// find the piece holding the newline that ends the previous line
+	const Node* node = root.get();
+	uint base = 0;
+	uint lines = 0;
+
+	while (node) {
+		auto left = node->left.get();
+		if (left && line <= lines+left->newlines) {
+			node = left;
+			continue;
+		}
+		if (left) {
+			base += left->cells;
+			lines += left->newlines;
+		}
+		auto& piece = node->piece;
+		if (line <= lines+piece.newlines) {
+			near = {node, base, lines};
+			auto bytes = data(piece);
+			uint need = line-lines;
+			for (uint i = 0, cell = 0; i < piece.bytes; i++) {
+				cell += !UTF8::continuation(bytes[i]);
+				if (bytes[i] == '\n' && !--need) return base+cell;
+			}
+			break;
+		}
+		base += piece.length;
+		lines += piece.newlines;
+		node = node->right.get();
+	}
+
+	ensure(false);
+	return 0;
+}
+
+uint Doc::line_count() const {
+	return size() ? root->newlines+1: 0;
+}
+
+uint32_t Doc::operator[](uint index) const {
+	auto span = locate(index);
+	auto& piece = span.node->piece;
+	auto bytes = data(piece);
+	uint cell = index-span.index;
+	if (piece.ascii()) return (uint8_t)bytes[cell];
+
+	// step from the last cell decoded in this piece, or from its start
+	// when that is closer
+	uint at = span.cell;
+	uint byte = span.byte;
+	if (cell < at && cell < at-cell) {
+		at = 0;
+		byte = 0;
+	}
+	for (; at < cell; at++) byte += UTF8::width(bytes[byte]);
+	for (; at > cell; at--) while (UTF8::continuation(bytes[--byte]));
+
+	near.cell = cell;
+	near.byte = byte;
+	return UTF8::decode(bytes+byte);
+}
+
+void Doc::push_back(uint32_t v) {
+	insert(end(), v);
+}
+
+static bool valid(const char* s, size_t length) {
+	return UTF8::validate(s, length) == length;
+}
+
+// Pieces over valid UTF-8, split on code point boundaries. Added text is
+// copied into the add buffer; original text is already in place at start.
+void Doc::chunks(vector<Piece>& run, const char* bytes, size_t length, size_t start, bool add) {
+	for (size_t i = 0; i < length; ) {
+		uint n = min((size_t)maxPiece, length-i);
+		while (i+n < length && UTF8::continuation(bytes[i+n])) n--;
+		size_t at = add ? append(bytes+i, n): start+i;
+		run.push_back(chunk(bytes+i, at, n, add));
+		i += n;
+	}
+}
+
+Doc::Tree Doc::pieces(const char* bytes, size_t length, size_t start, bool add) {
+	vector<Piece> run;
+	run.reserve(length/maxPiece+1);
+	chunks(run, bytes, length, start, add);
+	return build(run);
+}
+
+Doc::Tree Doc::build(const vector<Piece>& run) {
+	if (run.size() < 2) return run.size() ? leaf(run.front()): nullptr;
+
+	// Pieces arrive in order, so the treap is built in one pass along its
+	// right spine. Nodes popped off the spine are complete.
+	auto slab = new Slab;
+	slab->capacity = run.size();
+	SlabAllocator<Node> alloc(slab);
+
+	vector<Tree> spine;
+	for (auto& piece: run) {
+		auto node = allocate_shared<Node>(alloc);
+		node->piece = piece;
+		node->priority = random();
+		Tree last;
+		while (spine.size() && spine.back()->priority < node->priority) {
+			update(spine.back().get());
+			last = move(spine.back());
+			spine.pop_back();
+		}
+		node->left = move(last);
+		if (spine.size()) spine.back()->right = node;
+		spine.push_back(move(node));
+	}
+	while (spine.size() > 1) {
+		update(spine.back().get());
+		spine.pop_back();
+	}
+	update(spine.front().get());
+	return spine.front();
+}
+
+// The pieces are listed in order with the patched ranges cut out and the
+// new text in their place, then built into a fresh treap. Pieces partly
+// kept are rescanned only over the part kept, so the whole pass is linear
+// in the pieces and the bytes inserted, where separate edits would each
+// split and merge their way down the tree.
+void Doc::patch(const vector<Patch>& patches) {
+	if (patches.empty()) return;
+	for (uint i = 1; i < patches.size(); i++) {
+		ensure(patches[i-1].offset+patches[i-1].removed <= patches[i].offset);
+	}
+	ensure(patches.back().offset+patches.back().removed <= size());
+
+	// a few edits are cheaper in place
+	if (patches.size() < 64) {
+		for (int i = (int)patches.size()-1; i >= 0; i--) {
+			auto& patch = patches[i];
+			erase(begin()+patch.offset, patch.removed);
+			insert(begin()+patch.offset, patch.text);
+		}
+		return;
+	}
+
+	detach();
+	near = {};
+
+	vector<Piece> run;
+	vector<uint> inserted;
+	uint next = 0;
+	uint skip = 0;
+
+	auto place = [&](const Patch& patch) {
+		uint cells = 0;
+		size_t first = run.size();
+		if (valid(patch.text.data(), patch.text.size())) {
+			chunks(run, patch.text.data(), patch.text.size(), 0, true);
+		}
+		else {
+			auto text = UTF8(UTF8(patch.text).codes).text;
+			chunks(run, text.data(), text.size(), 0, true);
+		}
+		for (size_t i = first; i < run.size(); i++) cells += run[i].length;
+		inserted.push_back(cells);
+		skip = patch.removed;
+		next++;
+	};
+
+	uint offset = 0;
+	auto visit = [&](const Piece& piece, uint, uint) {
+		auto bytes = data(piece);
+		uint cell = 0, byte = 0;
+		auto seek = [&](uint target) {
+			if (piece.ascii()) byte = target;
+			else for (; cell < target; cell++) byte += UTF8::width(bytes[byte]);
+			cell = target;
+		};
+		auto keep = [&](uint target) {
+			if (target == cell) return;
+			if (!cell && target == piece.length) {
+				run.push_back(piece);
+				cell = target;
+				return;
+			}
+			uint first = byte;
+			seek(target);
+			run.push_back(chunk(bytes+first, piece.start+first, byte-first, piece.add));
+		};
+		for (;;) {
+			if (skip) {
+				uint n = min(skip, piece.length-cell);
+				seek(cell+n);
+				skip -= n;
+			}
+			if (cell == piece.length) break;
+			if (next < patches.size() && patches[next].offset < offset+piece.length) {
+				keep(patches[next].offset-offset);
+				place(patches[next]);
+				continue;
+			}
+			keep(piece.length);
+			break;
+		}
+		offset += piece.length;
+		return true;
+	};
+	walk(root.get(), 0, 0, size(), visit);
+	// insertions at the very end
+	while (next < patches.size()) place(patches[next]);
+
+	root = build(run);
+
+	int shift = 0;
+	for (uint i = 0; i < patches.size(); i++) {
+		record(patches[i].offset+shift, patches[i].removed, inserted[i]);
+		shift += (int)inserted[i]-(int)patches[i].removed;
+	}
+}
+
+// The first bulk load becomes the original buffer. That is shared with
+// copies and never grows, so later loads are appended to the add buffer.
+// Only invalid input pays for a full decode.
+void Doc::push_back(string s) {
+	if (!valid(s.data(), s.size())) s = UTF8(UTF8(s).codes).text;
+
+	detach();
+	near = {};
+
+	uint before = size();
+	if (original) {
+		root = merge(move(root), pieces(s.data(), s.size(), 0, true));
+	}
+	else {
+		original = make_shared<const string>(move(s));
+		root = merge(move(root), pieces(original->data(), original->size(), 0, false));
+	}
+	record(before, 0, size()-before);
+}
+
+Doc::Mapping::Mapping(const string& path) {
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) return;
+	struct stat st;
+	if (!fstat(fd, &st) && st.st_size > 0) {
+		void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr != MAP_FAILED) {
+			madvise(addr, st.st_size, MADV_SEQUENTIAL);
+			data = (const char*)addr;
+			size = st.st_size;
+		}
+	}
+	::close(fd);
+}
+
+Doc::Mapping::~Mapping() {
+	if (data) munmap((void*)data, size);
+}
+
+// Use the first limit bytes of a mapped file in place as the document,
+// trimmed back to a code point boundary. Fails if the text is not valid
+// UTF-8, since it cannot be repaired without a copy.
+bool Doc::map(shared_ptr<const Mapping> file, size_t limit, size_t from) {
+	clear();
+	if (!file || !file->data || from > file->size) return false;
+
+	size_t end = from + min(limit, file->size-from);
+	while (end < file->size && end > from && UTF8::continuation(file->data[end])) end--;
+	if (!valid(file->data+from, end-from)) return false;
+
+	mapping = file;
+	root = pieces(mapping->data+from, end-from, from, false);
+	record(0, 0, size());
+	return true;
+}
+
+// take a private copy of a mapped original buffer; piece offsets are unchanged
+void Doc::detach() {
+	if (!mapping) return;
+	original = make_shared<const string>(mapping->data, mapping->size);
+	mapping.reset();
+	near = {};
+}
+
+// write a batch of chunks, resuming after short writes
+static bool writeAll(int fd, vector<iovec>& chunks) {
+	auto iov = chunks.data();
+	size_t n = chunks.size();
+	while (n) {
+		ssize_t w = writev(fd, iov, min(n, (size_t)IOV_MAX));
+		if (w < 0 && errno == EINTR) continue;
+		if (w < 0) return false;
+		for (; n && (size_t)w >= iov->iov_len; iov++, n--) w -= iov->iov_len;
+		if (n) {
+			iov->iov_base = (char*)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	chunks.clear();
+	return true;
+}
+
+// gather the pieces' bytes straight from the buffers into fd
+bool Doc::write(int fd) const {
+	bool ok = true;
+	vector<iovec> chunks;
+	chunks.reserve(IOV_MAX);
+	auto gather = [&](const Piece& piece, uint, uint) {
+		chunks.push_back({(void*)data(piece), piece.bytes});
+		if (chunks.size() == IOV_MAX) ok = ok && writeAll(fd, chunks);
+		return ok;
+	};
+	walk(root.get(), 0, 0, size(), gather);
+	return ok && writeAll(fd, chunks);
+}
+
+// The text goes into a temporary file beside the file path resolves to,
+// which then replaces it in one rename. A crash leaves either the old file
+// or the new one. Symlinks are written through and an existing file keeps
+// its permissions and owner. A file with other hard links, or whose owner
+// cannot be kept, is overwritten in place instead.
+bool Doc::save(const string& path, bool sync) const {
+	char* real = realpath(path.c_str(), nullptr);
+	string target = real ? real: path;
+	free(real);
+
+	struct stat st;
+	bool exists = !stat(target.c_str(), &st);
+	if (exists && S_ISREG(st.st_mode) && st.st_nlink > 1) return overwrite(target, sync);
+
+	static atomic<uint> serial = 0;
+	string tmp = fmt("%s.%d-%u.tmp", target, getpid(), serial++);
+
+	// a directory we can't create in may still hold a file we can write
+	int fd = ::open(tmp.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0666);
+	if (fd < 0) {
+		bool denied = errno == EACCES || errno == EROFS || errno == EPERM;
+		return denied && exists && S_ISREG(st.st_mode) && overwrite(target, sync);
+	}
+
+	if (exists && (fchown(fd, st.st_uid, st.st_gid) || fchmod(fd, st.st_mode & 07777))) {
+		::close(fd);
+		unlink(tmp.c_str());
+		return S_ISREG(st.st_mode) && overwrite(target, sync);
+	}
+
+	bool ok = write(fd);
+	if (sync) ok = ok && !fsync(fd);
+	ok = !::close(fd) && ok;
+	ok = ok && !rename(tmp.c_str(), target.c_str());
+	if (!ok) {
+		unlink(tmp.c_str());
+		return false;
+	}
+
+	// make the rename itself durable
+	if (sync) {
+		auto slash = target.rfind('/');
+		auto dir = slash == string::npos ? string("."): target.substr(0, max(slash, (size_t)1));
+		int dfd = ::open(dir.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		if (dfd >= 0) {
+			fsync(dfd);
+			::close(dfd);
+		}
+	}
+	return true;
+}
+
+// Truncating a file that is still mapped would pull the text from under
+// the write, so mapped text is only ever renamed into place.
+bool Doc::overwrite(const string& path, bool sync) const {
+	if (mapped()) return false;
+	int fd = ::open(path.c_str(), O_WRONLY|O_TRUNC|O_CLOEXEC);
+	if (fd < 0) return false;
+	bool ok = write(fd);
+	if (sync) ok = ok && !fsync(fd);
+	return !::close(fd) && ok;
+}
+
+vector<uint32_t> Doc::codes(uint offset, uint length) const {
+	vector<uint32_t> out;
+	if (offset >= size()) return out;
+	length = min(length, size()-offset);
+	out.reserve(length);
+
+	auto copy = [&](const Piece& piece, uint from, uint to) {
+		auto bytes = data(piece);
+		for (uint byte = this->offset(piece, from); from < to; from++) {
+			out.push_back(UTF8::decode(bytes+byte));
+			byte += UTF8::width(bytes[byte]);
+		}
+		return true;
+	};
+
+	walk(root.get(), 0, offset, offset+length, copy);
+	return out;
+}
+
+string Doc::extract(size_t offset, size_t length) const {
+	string out;
+	if (offset >= size()) return out;
+	length = min(length, size()-offset);
+
+	auto copy = [&](const Piece& piece, uint from, uint to) {
+		auto bytes = data(piece);
+		out.append(bytes+this->offset(piece, from), bytes+this->offset(piece, to));
+		return true;
+	};
+
+	walk(root.get(), 0, offset, offset+length, copy);
+	return out;
+}
+
+void Doc::for_each_span(uint offset, uint length, const function<bool(span<const uint32_t>)>& fn) const {
+	if (offset >= size()) return;
+	length = min(length, size()-offset);
+
+	// a piece never holds more code points than bytes
+	vector<uint32_t> scratch(maxPiece);
+
+	auto visit = [&](const Piece& piece, uint from, uint to) {
+		auto bytes = data(piece);
+		if (piece.ascii()) {
+			for (uint i = from; i < to; i++) scratch[i-from] = (uint8_t)bytes[i];
+		}
+		else {
+			bytes += this->offset(piece, from);
+			for (uint i = from; i < to; i++) {
+				scratch[i-from] = UTF8::decode(bytes);
+				bytes += UTF8::width(*bytes);
+			}
+		}
+		return fn({scratch.data(), to-from});
+	};
+
+	walk(root.get(), 0, offset, offset+length, visit);
+}
+
+uint32_t Doc::Reader::next() {
+	if (done()) return 0;
+	if (bytes == end) {
+		auto span = doc->locate(offset);
+		auto& piece = span.node->piece;
+		bytes = doc->data(piece);
+		end = bytes + piece.bytes;
+		bytes += doc->offset(piece, offset-span.index);
+	}
+	offset++;
+	uint32_t c = UTF8::decode(bytes);
+	bytes += UTF8::width(*bytes);
+	return c;
+}
+
+Doc Doc::subdoc(size_t offset, size_t length) const {
+	Doc out;
+	out.push_back(extract(offset, length));
+	return out;
+}
+
+Doc::iterator Doc::insert(iterator it, uint32_t v) {
+	uint index = it.ii;
+	detach();
+	near = {};
+
+	// typing straight after the most recent insertion extends its piece
+	if (extend(index, v)) {
+		record(index, 0, 1);
+		return iterator(this, index);
+	}
+
+	char bytes[4];
+	uint n = UTF8::encode(v, bytes);
+	Piece piece = {true, append(bytes, n), n, 1, v == '\n', hashBytes(0, bytes, n)};
+
+	auto [a, b] = split(move(root), index);
+	root = merge(merge(move(a), leaf(piece)), move(b));
+	record(index, 0, 1);
+	return iterator(this, index);
+}
+
+// Ranges are appended to the add buffer once and spliced in with a single
+// split, however many lines they span.
+Doc::iterator Doc::insert(iterator it, string s) {
+	uint index = it.ii;
+	if (s.empty()) return iterator(this, index);
+	if (!valid(s.data(), s.size())) s = UTF8(UTF8(s).codes).text;
+
+	detach();
+	near = {};
+
+	uint before = size();
+	auto [a, b] = split(move(root), index);
+	root = merge(merge(move(a), pieces(s.data(), s.size(), 0, true)), move(b));
+	record(index, 0, size()-before);
+	return iterator(this, index);
+}
+
+Doc::iterator Doc::erase(iterator it, uint n) {
+	uint index = it.ii;
+	n = min(n, size()-index);
+	if (!n) return it;
+
+	detach();
+	near = {};
+
+	auto [a, rest] = split(move(root), index);
+	auto [gone, b] = split(move(rest), n);
+	root = merge(move(a), move(b));
+	record(index, n, 0);
+	return iterator(this, index);
+}
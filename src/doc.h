@@ -4,181 +4,246 @@
 #include "utf8.h"
 #include <deque>
 #include <vector>
+#include <memory>
 #include <cstring>
+#include <span>
+#include <functional>
+
+// Text is held as a piece table. Bulk loaded text lives in an append-only
+// original buffer, characters inserted by editing are appended to an add
+// buffer, and the document itself is the ordered list of pieces that each
+// reference a span of one buffer. Edits only split or trim pieces so typing
+// never shifts or copies the surrounding text.
+//
+// Buffers hold UTF-8 bytes, the same as the file on disk. Offsets, cells and
+// iterators still count code points: each piece knows how many it holds, and
+// all-ASCII pieces (the common case) map a cell straight to a byte.
+//
+// Very large files can be memory mapped read-only and used in place as the
+// original buffer. The first edit detaches, copying the mapping into memory.
+//
+// Copies are cheap snapshots. Buffers are immutable or append-only and tree
+// nodes are shared between copies, with edits copying only the nodes on the
+// paths they change.
+//
+// Every edit bumps a version and is recorded in a bounded journal, so
+// derived state can be patched from the changes since it was built rather
+// than recomputed.
+//
+// The pieces are kept in a treap ordered by document position. Every node
+// caches the cells and newlines in its subtree so that mapping an offset to
+// a line or a line to an offset is a single O(log n) descent. Nodes also
+// combine the rolling hashes of their pieces into a content hash.
 
 struct Doc {
 	Doc() = default;
-	Doc(std::initializer_list<uint32_t> l) {
-		for (auto v: l) push_back(v);
-	}
-	Doc(const Doc& other) {
-		operator=(other);
-	}
+	Doc(std::initializer_list<uint32_t> l);
+	Doc(const Doc& other);
+	Doc(Doc&& other) = default;
+	Doc& operator=(const Doc& other);
+	Doc& operator=(Doc&& other);
+	bool operator==(const Doc& other) const;
+
+	struct Piece {
+		bool add = false;
+		size_t start = 0;
+		uint bytes = 0;
+		uint length = 0;
+		uint newlines = 0;
+		uint64_t hash = 0;
+
+		bool ascii() const {
+			return bytes == length;
+		}
+	};
 
-	Doc& operator=(const Doc& other) {
-		clear();
-		count = other.count;
-		lines = other.lines;
-		last = other.last;
-		return *this;
-	}
+	struct Node {
+		Piece piece;
+		uint priority = 0;
+		// subtree totals
+		uint cells = 0;
+		uint newlines = 0;
+		// content hash and base^bytes, see hash()
+		uint64_t hash = 0;
+		uint64_t scale = 1;
+		std::shared_ptr<Node> left;
+		std::shared_ptr<Node> right;
+	};
 
-	bool operator==(const Doc& other) const {
-		return count == other.count && lines == other.lines;
-	}
+	typedef std::shared_ptr<Node> Tree;
 
-	uint count = 0;
-	std::vector<std::vector<uint32_t>> lines;
+	// Pieces are capped in bytes so that locating a cell within one stays cheap
+	static const uint maxPiece = 4096;
 
-	struct Cursor {
-		uint index = 0;
-		uint line = 0;
-		uint cell = 0;
+	// read-only file mapping
+	struct Mapping {
+		const char* data = nullptr;
+		size_t size = 0;
+		Mapping(const std::string& path);
+		~Mapping();
 	};
 
-	bool sanity() {
-		uint sum = 0;
-		for (uint i = 0; i < lines.size()-1; i++) {
-			if (lines[i].back() != '\n') return false;
-			sum += lines[i].size();
-		}
-		if (lines.size()) {
-			sum += lines.back().size();
-		}
-		return sum == count;
-	};
+	// Typed text goes into fixed size blocks that never move, so copies can
+	// keep reading them while this doc appends
+	static const size_t addBlock = 1<<16;
 
-	mutable Cursor last;
-
-	void clear() {
-		lines.clear();
-		count = 0;
-		last.index = 0;
-		last.line = 0;
-		last.cell = 0;
+	struct Block {
+		char bytes[addBlock];
 	};
 
-	Cursor cursor(uint index) const {
-		ensure(index <= size());
+	typedef std::vector<std::shared_ptr<Block>> Blocks;
 
-		if (index == 0) {
-			last = {0,0,0};
-			return last;
-		}
+	std::shared_ptr<const std::string> original;
+	std::shared_ptr<Blocks> added;
+	size_t tail = 0;
+	std::shared_ptr<const Mapping> mapping;
+	Tree root;
+	uint32_t seed = 0x9e3779b9;
 
-		if (index == size()) {
-			last = {index,(uint)lines.size()-1,(uint)lines.back().size()};
-			return last;
-		}
+	// An edit replacing removed cells at offset with inserted cells. Whole
+	// document replacements are recorded as one change from offset 0.
+	struct Change {
+		uint offset = 0;
+		uint removed = 0;
+		uint inserted = 0;
 
-		while (last.index > index) {
-			// try to jump straight the beginning of the current line
-			if (last.cell > 0 && last.index-last.cell >= index) {
-				last.index -= last.cell;
-				last.cell = 0;
-				continue;
-			}
-			// walk backward on the current line
-			if (last.cell > 0) {
-				last.cell--;
-				last.index--;
-				continue;
-			}
-			ensure(!last.cell);
-			ensure(last.line > 0);
-			last.line--;
-			last.cell = lines[last.line].size()-1;
-			last.index--;
+		// where a position ends up after this change; positions inside the
+		// removed range move to its start
+		uint shift(uint position) const {
+			if (position < offset) return position;
+			if (position < offset+removed) return offset;
+			return position-removed+inserted;
 		}
 
-		while (last.index < index) {
-			uint len = lines[last.line].size();
-			ensure(len > 0);
-			uint rem = len-last.cell-1;
-			// try to jump straight the end of the current line
-			if (last.cell < len-1 && last.index+rem <= index) {
-				last.index += rem;
-				last.cell = len-1;
-				continue;
-			}
-			// walk forward on the current line
-			if (last.cell < len-1) {
-				last.cell++;
-				last.index++;
-				continue;
-			}
-			ensure(last.cell == len-1);
-			ensure(last.line < lines.size()-1);
-			last.line++;
-			last.cell = 0;
-			last.index++;
+		bool operator==(const Change& o) const {
+			return offset == o.offset && removed == o.removed && inserted == o.inserted;
 		}
+	};
 
-		ensure(last.index == index);
-		return last;
-	}
+	static const uint journalLimit = 1024;
 
-	uint line_offset(uint line) {
-		ensure(line < lines.size());
+	// journal.back() made the current version. Copies keep the version but
+	// start with an empty journal.
+	uint64_t version = 0;
+	std::deque<Change> journal;
 
-		last.index -= last.cell;
-		last.cell = 0;
+	struct Cursor {
+		uint index = 0;
+		uint line = 0;
+		uint cell = 0;
+	};
 
-		while (last.line > line) {
-			last.line--;
-			last.index -= lines[last.line].size();
-		}
+	// A piece, the offset of its first cell and the newlines before it.
+	// Also the last cell decoded within the piece and its byte offset, so
+	// sequential reads of non-ASCII text step rather than rescan.
+	struct Span {
+		const Node* node = nullptr;
+		uint index = 0;
+		uint line = 0;
+		uint cell = 0;
+		uint byte = 0;
+	};
 
-		while (last.line < line) {
-			last.index += lines[last.line].size();
-			last.line++;
-		}
+	// most recently located piece, for sequential access
+	mutable Span near;
+
+	bool sanity() const;
+	void clear();
 
-		return last.index;
+	// true when the journal still holds every change made since a version
+	bool recent(uint64_t since) const {
+		return since <= version && version-since <= journal.size();
 	}
 
-	uint32_t* cell(uint index) const {
-		ensure(index < size());
-		auto cur = cursor(index);
-		return (uint32_t*)&lines[cur.line][cur.cell];
+	// the changes made since a version, oldest first, if recent(since)
+	std::vector<Change> changes(uint64_t since) const;
+
+	// Text changed since some version: length cells now at offset where
+	// removed cells were. Kept sorted and apart, so a change touching
+	// several joins them.
+	struct Region {
+		uint offset = 0;
+		uint length = 0;
+		uint removed = 0;
 	};
 
+	static void fold(std::vector<Region>& regions, const Change& change);
+
+	// the changes made since a version merged into regions, if recent(since)
+	std::vector<Region> regions(uint64_t since) const;
+
+	Span locate(uint index) const;
+	Cursor cursor(uint index) const;
+	uint line_offset(uint line) const;
+	uint line_count() const;
+
 	uint size() const {
-		return count;
+		return root ? root->cells: 0;
 	};
 
-	void push_back(uint32_t v) {
-		insert(end(), v);
-	}
+	void push_back(uint32_t v);
+	void push_back(std::string s);
+
+	// use up to limit bytes of a mapping from byte from in place
+	bool map(std::shared_ptr<const Mapping> file, size_t limit = -1, size_t from = 0);
+	void detach();
 
-	void push_back(std::string s) {
-		UTF8 utf8(s);
-		UTF8 test(utf8.text);
-		if (utf8.codes != test.codes) notef("in codes don't match");
-		if (utf8.text != test.text) notef("in texts don't match");
-		for (auto c: utf8.codes) push_back(c);
+	// write to path atomically, optionally flushed through to the disk
+	bool save(const std::string& path, bool sync = true) const;
+	bool overwrite(const std::string& path, bool sync) const;
+	bool write(int fd) const;
+
+	// Content hash of the UTF-8 bytes, stable across runs. Kept up to date
+	// in the tree by every edit, so reading it is O(1).
+	uint64_t hash() const {
+		return root ? root->hash: 0;
 	}
 
-	std::string extract(size_t offset, size_t length) const {
-		std::vector<uint32_t> out;
-		for (size_t i = offset; i < offset+length && i < size(); i++)
-			out.push_back(*cell(i));
-		UTF8 utf8(out);
-		UTF8 test(utf8.text);
-		if (utf8.codes != test.codes) notef("out codes don't match");
-		if (utf8.text != test.text) notef("out texts don't match");
-		return utf8;
+	// the same hash of raw bytes, such as a file on disk
+	static uint64_t hash(const char* bytes, size_t length);
+
+	bool mapped() const {
+		return mapping != nullptr;
 	}
 
+	std::vector<uint32_t> codes(uint offset, uint length) const;
+	std::string extract(size_t offset, size_t length) const;
+
 	operator std::string() const {
 		return extract((size_t)0, size());
 	}
 
-	Doc subdoc(size_t offset, size_t length) const {
-		Doc out;
-		for (size_t i = offset; i < offset+length && i < size(); i++)
-			out.push_back(*cell(i));
-		return out;
+	Doc subdoc(size_t offset, size_t length) const;
+
+	// An immutable O(1) copy for background readers. The located-piece cache
+	// makes reads non-reentrant, so each reading thread takes its own.
+	std::shared_ptr<const Doc> snapshot() const {
+		return std::make_shared<const Doc>(*this);
+	}
+
+	// Visit [offset,offset+length) as contiguous runs of code points, one per
+	// piece, decoded into a scratch buffer. Stops early if fn returns false.
+	void for_each_span(uint offset, uint length, const std::function<bool(std::span<const uint32_t>)>& fn) const;
+
+	// Sequential reads from an offset, stepping through the bytes of the
+	// current piece and only descending the tree when crossing into the next.
+	// Valid until the next edit.
+	struct Reader {
+		const Doc* doc = nullptr;
+		uint offset = 0;
+		const char* bytes = nullptr;
+		const char* end = nullptr;
+
+		bool done() const {
+			return offset >= doc->size();
+		}
+
+		// code point at offset then advance, 0 when done
+		uint32_t next();
+	};
+
+	Reader read(uint offset) const {
+		return {this, offset};
 	}
 
 	class iterator {
@@ -189,7 +254,7 @@ struct Doc {
 		typedef uint32_t value_type;
 		typedef uint difference_type;
 		typedef value_type* pointer;
-		typedef value_type& reference;
+		typedef value_type reference;
 		typedef std::input_iterator_tag iterator_category;
 
 		explicit iterator(const Doc* ddoc, uint iii) {
@@ -206,14 +271,9 @@ struct Doc {
 			return doc->cursor(ii);
 		}
 
-		value_type& operator*() const {
-			ensure(valid());
-			return *doc->cell(ii);
-		}
-
-		value_type* operator->() const {
+		value_type operator*() const {
 			ensure(valid());
-			return doc->cell(ii);
+			return (*doc)[ii];
 		}
 
 		bool operator==(const iterator& other) const {
@@ -300,97 +360,40 @@ struct Doc {
 		return iterator(this, size());
 	};
 
-	const uint32_t& operator[](uint index) const {
-		return *cell(index);
-	};
-
-	iterator insert(iterator it, uint32_t v) {
-		if (!lines.size()) {
-			lines.push_back({v});
-			count++;
-			if (v == '\n') lines.push_back({});
-			return begin();
-		}
-		if (it == end() && v != '\n') {
-			lines.back().push_back(v);
-			count++;
-			return iterator(this, it.ii);
-		}
-		if (it == end() && v == '\n') {
-			lines.back().push_back(v);
-			count++;
-			lines.push_back({});
-			return iterator(this, it.ii);
-		}
-
-		auto cur = it.cursor();
+	uint32_t operator[](uint index) const;
 
-		// move the cached cursor out of the way
-		if (last.index >= it.ii) {
-			cursor(std::max(0, (int)it.ii-1));
-		}
-
-		auto& line = lines[cur.line];
-		auto cit = line.begin()+cur.cell;
-		auto pos = line.insert(cit, v);
-		count++;
-		if (v == '\n') {
-			auto split = pos+1;
-			std::vector<uint32_t> eol = {split, line.end()};
-			line.erase(split, line.end());
-			auto lit = lines.begin()+cur.line;
-			lines.insert(lit+1, eol);
-		}
-		return iterator(this, it.ii);
-	};
+	iterator insert(iterator it, uint32_t v);
+	iterator insert(iterator it, std::string s);
 
 	template <typename IT>
 	iterator insert(iterator it, IT a, IT b) {
-		for (auto c = it; a != b; ) {
-			insert(c, *a);
-			++c;
-			++a;
-		}
-		return iterator(this, it.ii);
+		std::string s;
+		char bytes[4];
+		for (; a != b; ++a) s.append(bytes, UTF8::encode(*a, bytes));
+		return insert(it, std::move(s));
 	};
 
 	iterator erase(iterator it) {
-		if (it == end()) {
-			return it;
-		}
-
-		auto cur = it.cursor();
-
-		// move the cached cursor out of the way
-		if (last.index >= it.ii) {
-			cursor(std::max(0, (int)it.ii-1));
-		}
-
-		auto& line = lines[cur.line];
-		ensure(line.size());
-		uint32_t c = line[cur.cell];
-		line.erase(line.begin()+cur.cell);
-		count--;
-		if (c == '\n') {
-			ensure(cur.cell == line.size());
-			if (cur.line < lines.size()-1) {
-				auto& next = lines[cur.line+1];
-				line.insert(line.end(), next.begin(), next.end());
-				lines.erase(lines.begin()+cur.line+1);
-			}
-		}
-		return iterator(this, it.ii);
+		return erase(it, 1);
 	};
 
-	iterator erase(iterator it, uint n) {
-		for (uint i = 0; i < n; i++) it = erase(it);
-		return it;
-	};
+	iterator erase(iterator it, uint n);
 
 	iterator erase(iterator a, iterator b) {
 		return erase(a, b-a);
 	};
 
+	// Replacements of removed cells at offset with text, ascending and
+	// apart, offsets against the text before any of them
+	struct Patch {
+		uint offset = 0;
+		uint removed = 0;
+		std::string text;
+	};
+
+	// apply many replacements in one pass over the pieces
+	void patch(const std::vector<Patch>& patches);
+
 	std::string extract(iterator a, iterator b) {
 		return a < b ? extract(a-begin(), b-a): "";
 	}
@@ -404,4 +407,37 @@ struct Doc {
 		clear();
 		push_back(std::string(raw.begin(), raw.end()));
 	}
+
+	void record(uint offset, uint removed, uint inserted);
+
+	// treap internals
+	const char* data(const Piece& piece) const;
+	uint offset(const Piece& piece, uint cell) const;
+	uint tally(const Piece& piece, uint length) const;
+	Piece chunk(const char* bytes, size_t start, uint length, bool add) const;
+	void chunks(std::vector<Piece>& run, const char* bytes, size_t length, size_t start, bool add);
+	Tree pieces(const char* bytes, size_t length, size_t start, bool add);
+	Tree build(const std::vector<Piece>& run);
+	size_t append(const char* bytes, uint length);
+	uint random();
+	Tree leaf(const Piece& piece);
+	static void update(Node* node);
+	static Node* own(Tree& node);
+	std::pair<Tree,Tree> split(Tree node, uint index);
+	Tree merge(Tree a, Tree b);
+	bool extend(uint index, uint32_t v);
+	void grow(Tree& node, uint index, const char* bytes, uint length, bool newline);
+
+	// visit the pieces overlapping [offset,limit) in order, passing each
+	// piece with the range of its cells that overlap, until fn returns false
+	template <typename F>
+	bool walk(const Node* node, uint base, uint offset, uint limit, F& fn) const {
+		if (!node || base >= limit || base+node->cells <= offset) return true;
+		uint start = base + (node->left ? node->left->cells: 0);
+		uint end = start + node->piece.length;
+		if (!walk(node->left.get(), base, offset, limit, fn)) return false;
+		if (start < limit && end > offset)
+			if (!fn(node->piece, std::max(offset, start)-start, std::min(limit, end)-start)) return false;
+		return walk(node->right.get(), end, offset, limit, fn);
+	}
 };
@@ -362,11 +362,12 @@ int main(int argc, const char* argv[]) {
 		auto processEvent = [&]() {
 			if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_FOCUS_GAINED) {
 				gotFocus = now();
+				project.focused();
 			}
 
 			if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_FOCUS_LOST) {
 				lostFocus = now();
-				if (project.autosave) project.save();
+				if (project.autosave) project.save("", true);
 			}
 
 			immediate = ImGui_ImplSDL2_ProcessEvent(&event);
@@ -405,6 +406,10 @@ int main(int argc, const char* argv[]) {
 
 		SDL_GetWindowSize(window, &config.window.width, &config.window.height);
 
+		// keep polling until background saves report back
+		if (project.saved()) immediate = true;
+		project.refresh();
+
 		ImGui_ImplSDLRenderer_NewFrame();
 		ImGui_ImplSDL2_NewFrame(window);
 		ImGui::NewFrame();
@@ -664,6 +669,7 @@ int main(int argc, const char* argv[]) {
 
 						if (viewHasInput) {
 							view->input();
+							project.compact();
 						}
 
 						auto gap = GetStyle().ItemSpacing.x;
@@ -43,6 +43,10 @@ bool FilterPopup::enterable() {
 void FilterPopup::entered() {
 }
 
+// runs on the main thread before init() is queued on the worker
+void FilterPopup::prepare() {
+}
+
 std::string FilterPopup::hint() {
 	return name;
 }
@@ -58,6 +62,7 @@ void FilterPopup::setup() {
 		ready = false;
 		focus = false;
 		immediate = true;
+		prepare();
 		crew.job([&]() {
 			init();
 			sync.lock();
@@ -10,6 +10,7 @@ struct FilterPopup : Popup {
 	std::vector<std::string> options;
 	std::vector<int> visible;
 	int selected = 0;
+	virtual void prepare();
 	virtual void init() = 0;
 	virtual void chosen(int option) = 0;
 	virtual void entered();
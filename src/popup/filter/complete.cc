@@ -4,16 +4,17 @@ FilterPopupComplete::FilterPopupComplete() {
 	name = "complete";
 }
 
+// the word indexes make completion a lookup, done here on the main thread
+void FilterPopupComplete::prepare() {
+	options = project.autocomplete();
+}
+
 void FilterPopupComplete::init() {
 	prefix.clear();
-	if (project.views.size()) {
-		View tmp = *project.view();
-		options = tmp.autocomplete();
-		if (options.size()) {
-			prefix = options.front();
-			options.erase(options.begin());
-			std::snprintf(input, sizeof(input), "%s", prefix.c_str());
-		}
+	if (options.size()) {
+		prefix = options.front();
+		options.erase(options.begin());
+		std::snprintf(input, sizeof(input), "%s", prefix.c_str());
 	}
 }
 
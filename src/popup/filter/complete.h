@@ -3,6 +3,7 @@
 struct FilterPopupComplete : FilterPopup {
 	std::string prefix;
 	FilterPopupComplete();
+	void prepare();
 	void init();
 	void chosen(int option);
 };
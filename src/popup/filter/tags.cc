@@ -4,16 +4,21 @@ FilterPopupTags::FilterPopupTags() {
 	name = "tags";
 }
 
+void FilterPopupTags::prepare() {
+	view = project.views.size() ? project.view(): nullptr;
+	text = view ? view->text.snapshot(): nullptr;
+	syntax = view ? view->syntax: nullptr;
+}
+
 void FilterPopupTags::init() {
 	regions.clear();
-	if (project.views.size()) {
-		view = project.view();
-		View tmp = *view;
-		regions = tmp.syntax->tags(tmp.text);
+	if (text) {
+		regions = syntax->tags(*text);
 		for (auto region: regions) {
-			options.push_back(tmp.extract(region));
+			options.push_back(text->extract(region.offset, region.length));
 		}
 	}
+	text = nullptr;
 }
 
 void FilterPopupTags::chosen(int option) {
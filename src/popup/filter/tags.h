@@ -1,9 +1,12 @@
 #pragma once
 
 struct FilterPopupTags : FilterPopup {
-	View* view;
+	View* view = nullptr;
+	std::shared_ptr<const Doc> text;
+	std::shared_ptr<Syntax> syntax;
 	std::vector<ViewRegion> regions;
 	FilterPopupTags();
+	void prepare();
 	void init();
 	void chosen(int option);
 };
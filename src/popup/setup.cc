@@ -163,6 +163,44 @@ void SetupPopup::render() {
 			EndTabItem();
 		}
 
+		if (BeginTabItem("Undo##setup-tab-undo")) {
+			BeginTable("#undo", 4);
+
+			TableSetupColumn("File", ImGuiTableColumnFlags_WidthStretch);
+			TableSetupColumn("Undo");
+			TableSetupColumn("Redo");
+			TableSetupColumn("Memory");
+
+			TableHeadersRow();
+
+			size_t total = 0;
+
+			for (auto view: project.views) {
+				TableNextRow();
+
+				TableNextColumn();
+				Print(view->path.c_str());
+
+				TableNextColumn();
+				Print(fmtc("%d", (int)view->undos.size()));
+
+				TableNextColumn();
+				Print(fmtc("%d", (int)view->redos.size()));
+
+				TableNextColumn();
+				Print(fmtc("%.1f MB", view->history/1048576.0));
+
+				total += view->history;
+			}
+
+			EndTable();
+
+			NewLine();
+			Print(fmtc("%.1f MB of %.0f MB", total/1048576.0, config.view.undoTotal/1048576.0));
+
+			EndTabItem();
+		}
+
 		EndTabBar();
 	}
 }
@@ -5,6 +5,7 @@
 #include "channel.h"
 #include "workers.h"
 #include <fstream>
+#include <cstring>
 #include <filesystem>
 #include <string_view>
 #include <regex>
@@ -21,6 +22,11 @@ Project::Project() {
 }
 
 Project::~Project() {
+	stopping = true;
+	scanner.stop();
+	indexer.stop();
+	// queued saves still write the views' snapshots and the project state
+	View::writer.wait();
 	sanity();
 	while (views.size()) close();
 }
@@ -46,6 +52,22 @@ void Project::sanity() {
 	ensure(!viewset.size());
 }
 
+// Keep undo history across all views within the global budget by scaling
+// each view's share down in proportion. Runs once a frame, so it also hands
+// off whatever history the views dropped since the last.
+void Project::compact() {
+	size_t total = 0;
+	for (auto view: views) total += view->history;
+
+	if (total > config.view.undoTotal) {
+		for (auto view: views) {
+			view->compact((double)view->history/total*config.view.undoTotal);
+		}
+	}
+
+	for (auto view: views) view->release();
+}
+
 int Project::find(const string& vpath) {
 	auto it = find_if(views.begin(), views.end(), [&](auto view) { return view->path == vpath; });
 	return it == views.end() ? -1: it-views.begin();
@@ -112,32 +134,38 @@ void Project::searchPathAdd(const string& path) {
 	auto tpath = filesystem::path(path);
 	auto apath = filesystem::weakly_canonical(tpath);
 	searchPaths.insert(apath.string());
+	reindex();
 }
 
 void Project::searchPathDrop(const string& path) {
 	auto tpath = filesystem::path(path);
 	auto apath = filesystem::weakly_canonical(tpath);
 	searchPaths.erase(apath.string());
+	reindex();
 }
 
 void Project::ignorePathAdd(const string& path) {
 	auto tpath = filesystem::path(path);
 	auto apath = filesystem::weakly_canonical(tpath);
 	ignorePaths.insert(apath.string());
+	reindex();
 }
 
 void Project::ignorePathDrop(const string& path) {
 	auto tpath = filesystem::path(path);
 	auto apath = filesystem::weakly_canonical(tpath);
 	ignorePaths.erase(apath.string());
+	reindex();
 }
 
 void Project::ignorePatternAdd(const string& pattern) {
 	ignorePatterns.insert(pattern);
+	reindex();
 }
 
 void Project::ignorePatternDrop(const string& pattern) {
 	ignorePatterns.erase(pattern);
+	reindex();
 }
 
 bool Project::interpret(const string& cmd) {
@@ -250,30 +278,28 @@ bool Project::load(const string path) {
 		config.layout2.split = pstate["/config/layout2/split"_json_pointer];
 	}
 
+	reindex();
 	return true;
 }
 
-bool Project::save(const string path) {
+// The state is gathered on the UI thread with paths as they are, then
+// canonicalised and written to a temporary file renamed over the old one.
+// Background writes queue behind the views' saves, and a queued write is
+// dropped when a newer one follows it.
+bool Project::save(const string path, bool background) {
 	const string spath = path.empty() ? ppath: path;
 	if (spath.empty()) return false;
 
-	auto tpath = filesystem::path(spath);
-	auto apath = filesystem::weakly_canonical(tpath);
-	ppath = apath.string();
-
-	auto out = ofstream(spath);
-	if (!out) return false;
+	ppath = filesystem::weakly_canonical(filesystem::path(spath)).string();
 
 	json pstate;
 	pstate["autosave"] = autosave;
 
 	int i = 0;
 	for (auto view: views) {
-		if (view->modified) view->save();
-		auto vpath = filesystem::path(view->path);
-		auto apath = filesystem::weakly_canonical(vpath);
+		if (view->modified) view->save(background);
 		json vstate;
-		vstate["path"] = apath;
+		vstate["path"] = view->path;
 		int j = 0;
 		for (auto selection: view->selections) {
 			int k = j++;
@@ -291,25 +317,19 @@ bool Project::save(const string path) {
 		json gstate;
 		int j = 0;
 		for (auto view: group) {
-			auto vpath = filesystem::path(view->path);
-			auto apath = filesystem::weakly_canonical(vpath);
-			gstate["views"][j++] = apath;
+			gstate["views"][j++] = view->path;
 		}
 		pstate["groups"][i++] = gstate;
 	}
 
 	i = 0;
 	for (auto searchPath: searchPaths) {
-		auto spath = filesystem::path(searchPath);
-		auto apath = filesystem::weakly_canonical(spath);
-		pstate["searchPaths"][i++] = apath;
+		pstate["searchPaths"][i++] = searchPath;
 	}
 
 	i = 0;
 	for (auto ignorePath: ignorePaths) {
-		auto spath = filesystem::path(ignorePath);
-		auto apath = filesystem::weakly_canonical(spath);
-		pstate["ignorePaths"][i++] = apath;
+		pstate["ignorePaths"][i++] = ignorePath;
 	}
 
 	i = 0;
@@ -320,10 +340,58 @@ bool Project::save(const string path) {
 	pstate["config"]["sidebar"]["width"] = config.sidebar.width;
 	pstate["config"]["layout2"]["split"] = config.layout2.split;
 
-	out << pstate.dump(4);
-	out.close();
+	auto ticket = ++*stored;
 
-	return true;
+	auto write = [stored=stored,spath,ticket,pstate=std::move(pstate)]() mutable {
+		if (ticket != *stored) return true;
+
+		auto canonical = [](json& value) {
+			value = filesystem::weakly_canonical(filesystem::path(value.get<string>())).string();
+		};
+		for (auto& vstate: pstate["views"]) canonical(vstate["path"]);
+		for (auto& gstate: pstate["groups"]) {
+			for (auto& vpath: gstate["views"]) canonical(vpath);
+		}
+		for (auto& search: pstate["searchPaths"]) canonical(search);
+		for (auto& ignore: pstate["ignorePaths"]) canonical(ignore);
+
+		auto tmp = spath+".tmp";
+		auto out = ofstream(tmp);
+		if (!out) return false;
+		out << pstate.dump(4);
+		out.close();
+
+		error_code ec;
+		if (out) filesystem::rename(tmp, spath, ec);
+		if (!out || ec) {
+			filesystem::remove(tmp, ec);
+			notef("save failed: %s", spath);
+			return false;
+		}
+		return true;
+	};
+
+	if (background) {
+		View::writer.start(1);
+		View::writer.job(write);
+		return true;
+	}
+
+	View::writer.wait();
+	return write();
+}
+
+// adopt finished background saves, true while any are still queued
+bool Project::saved() {
+	bool waiting = false;
+	for (auto view: views) waiting = view->saved() || waiting;
+	return waiting;
+}
+
+// back from another program: pick up files it changed
+void Project::focused() {
+	for (auto view: views) view->revert();
+	reindex();
 }
 
 void Project::forget(View* view) {
@@ -457,6 +525,10 @@ void Project::moveNextGroup() {
 }
 
 vector<string> Project::files() {
+	return files(searchPaths, ignorePaths, ignorePatterns);
+}
+
+vector<string> Project::files(const set<string>& searchPaths, const set<string>& ignorePaths, const set<string>& ignorePatterns) {
 	using namespace filesystem;
 
 	set<path> seen;
@@ -532,6 +604,121 @@ vector<Project::Match> Project::search(string needle) {
 	return matches.recv_all();
 }
 
+// Scan the project in the background, reading only files modified since
+// they were last indexed and dropping those that have gone. A scan asked
+// for while one runs starts from refresh() once it is done.
+void Project::reindex() {
+	rescan = true;
+	if (scanning.exchange(true)) return;
+	rescan = false;
+	scanner.start();
+	scanner.job([&,paths=searchPaths,ignore=ignorePaths,patterns=ignorePatterns]() {
+		auto all = files(paths, ignore, patterns);
+
+		workers crew;
+		crew.start(8);
+
+		for (auto& path: all) {
+			crew.job([&]() {
+				if (stopping) return;
+				error_code ec;
+				auto stamp = filesystem::last_write_time(path, ec).time_since_epoch().count();
+				if (ec || lexicon.fresh(path, stamp)) return;
+				auto bytes = filesystem::file_size(path, ec);
+				if (ec || bytes >= config.view.large) return;
+
+				auto in = ifstream(path);
+				if (!in) return;
+				string content((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+				if (memchr(content.data(), 0, content.size())) return;
+
+				Doc text;
+				text.push_back(std::move(content));
+				Words words;
+				words.rebuild(text);
+				lexicon.assign(path, words.counts, stamp);
+			});
+		}
+
+		crew.wait();
+		if (!stopping) lexicon.retain({all.begin(), all.end()});
+		scanned = chrono::steady_clock::now();
+		scanning = false;
+	});
+}
+
+// Once a frame: send open views whose text changed to the indexer, let
+// closed ones fall back to disk, and rescan after a save or a close or
+// every [edit] rescan seconds after the last scan, for edits made outside
+void Project::refresh() {
+	set<string> open;
+	auto every = config.view.rescan;
+	bool stale = every.count() && !scanning && chrono::steady_clock::now()-scanned.load() > every;
+
+	for (auto view: views) {
+		if (!view->path.size()) continue;
+		open.insert(view->path);
+
+		auto& pin = pins[view->path];
+		stale = stale || (pin.sent && pin.orig != view->orig);
+		pin.orig = view->orig;
+
+		auto& text = view->text;
+		auto hash = text.hash();
+		if (pin.sent && pin.version == text.version && pin.hash == hash) continue;
+
+		optional<vector<Doc::Region>> regions;
+		if (pin.sent && pin.version != text.version && text.recent(pin.version)) {
+			regions = text.regions(pin.version);
+		}
+
+		indexer.start();
+		indexer.job([&,path=view->path,snapshot=text.snapshot(),regions=std::move(regions),since=pin.version]() {
+			auto& words = live[path];
+			if (regions && words.base && words.version == since) {
+				words.patch(*snapshot, *regions);
+			}
+			else {
+				words.rebuild(*snapshot);
+			}
+			lexicon.pin(path, words.counts);
+		});
+
+		pin = {true, text.version, hash, view->orig};
+	}
+
+	for (auto it = pins.begin(); it != pins.end(); ) {
+		if (open.count(it->first)) { ++it; continue; }
+		indexer.job([&,path=it->first]() {
+			live.erase(path);
+			lexicon.unpin(path);
+		});
+		it = pins.erase(it);
+		stale = true;
+	}
+
+	if (stale || (rescan && !scanning)) reindex();
+}
+
+// The active view's completions, led by its prefix and preceded by words
+// from across the project that extend it, most frequent first
+vector<string> Project::autocomplete() {
+	if (!views.size()) return {};
+	auto local = view()->autocomplete();
+	if (!local.size()) return {};
+
+	auto& prefix = local.front();
+	vector<string> results = {prefix};
+	set<string> seen = {prefix};
+	for (auto& word: lexicon.complete(prefix, 200)) {
+		if (seen.insert(word).second) results.push_back(word);
+	}
+	for (auto& word: local) {
+		if (seen.insert(word).second) results.push_back(word);
+	}
+	return results;
+}
+
 void Project::layout1() {
 	groups.clear();
 	groups.resize(1);
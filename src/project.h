@@ -2,7 +2,12 @@
 
 #include "view.h"
 #include "repo.h"
+#include "words.h"
+#include "workers.h"
 #include <map>
+#include <atomic>
+#include <chrono>
+#include <optional>
 
 struct Project {
 	int active = 0;
@@ -34,9 +39,14 @@ struct Project {
 
 	bool interpret(const std::string& cmd);
 	bool load(const std::string path);
-	bool save(const std::string path = "");
+	bool save(const std::string path = "", bool background = false);
+	bool saved();
+	void focused();
+	// the latest project state save requested, shared with queued writes
+	std::shared_ptr<std::atomic<uint64_t>> stored = std::make_shared<std::atomic<uint64_t>>(0);
 
 	void forget(View* view);
+	void compact();
 	bool known(View* view);
 	int group(View* view);
 	void bubble();
@@ -50,6 +60,36 @@ struct Project {
 	void moveNextGroup();
 
 	std::vector<std::string> files();
+	static std::vector<std::string> files(const std::set<std::string>& searchPaths, const std::set<std::string>& ignorePaths, const std::set<std::string>& ignorePatterns);
+
+	// Identifiers across the project's files and open views. Open views are
+	// sent to the indexer as snapshots with the regions changed since the
+	// last, and counted there in order. One scan at a time on the scanner
+	// rereads whichever files have changed on disk since the last.
+	Lexicon lexicon;
+	workers indexer;
+	workers scanner;
+	std::atomic<bool> scanning = false;
+	std::atomic<bool> rescan = false;
+	std::atomic<bool> stopping = false;
+	// when the last scan finished
+	std::atomic<std::chrono::steady_clock::time_point> scanned;
+
+	// what each open view last sent to the indexer
+	struct Pin {
+		bool sent = false;
+		uint64_t version = 0;
+		uint64_t hash = 0;
+		std::optional<uint64_t> orig;
+	};
+
+	std::map<std::string,Pin> pins;
+	// the open views' words, touched only by the indexer
+	std::map<std::string,Words> live;
+
+	void reindex();
+	void refresh();
+	std::vector<std::string> autocomplete();
 
 	struct Match {
 		std::string path;
@@ -0,0 +1,194 @@
+#include "search.h"
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+// bytes of multibyte code points count as word characters
+static bool word(uint8_t c) {
+	return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+// code points in a run of bytes, counting continuation bytes eight at a time
+static uint cells(const char* bytes, size_t length) {
+	uint n = length;
+	size_t i = 0;
+	for (; i+8 <= length; i += 8) {
+		uint64_t x;
+		memcpy(&x, bytes+i, 8);
+		n -= __builtin_popcountll(x & ~(x << 1) & 0x8080808080808080ull);
+	}
+	for (; i < length; i++) n -= UTF8::continuation(bytes[i]);
+	return n;
+}
+
+Search::Search(const string& n, bool f, bool w, bool p) : needle(n), fold(f), words(w), pattern(p) {
+	for (int c = 0; c < 256; c++) {
+		folding[c] = fold ? tolower(c): c;
+	}
+
+	if (pattern) {
+		try {
+			auto flags = regex::ECMAScript | regex::optimize;
+			if (fold) flags |= regex::icase;
+			expression = make_shared<const regex>(words ? "\\b(?:"+needle+")\\b": needle, flags);
+		}
+		catch (const regex_error&) {
+		}
+		return;
+	}
+
+	for (auto& c: needle) c = folding[(uint8_t)c];
+
+	size_t length = needle.size();
+	for (auto& s: skip) s = length;
+	for (size_t i = 0; i+1 < length; i++) {
+		skip[(uint8_t)needle[i]] = length-1-i;
+	}
+}
+
+// the first match of the needle's bytes starting within [from,last]
+size_t Search::find(const char* bytes, size_t from, size_t last) const {
+	size_t n = needle.size();
+
+	if (!fold && n < 4) {
+		for (size_t i = from; i <= last; i++) {
+			auto hit = (const char*)memchr(bytes+i, needle[0], last-i+1);
+			if (!hit) break;
+			i = hit-bytes;
+			if (!memcmp(hit, needle.data(), n)) return i;
+		}
+		return string::npos;
+	}
+
+	auto equal = [&](size_t i) {
+		for (size_t j = 0; j < n; j++) {
+			if (folding[(uint8_t)bytes[i+j]] != (uint8_t)needle[j]) return false;
+		}
+		return true;
+	};
+
+	for (size_t i = from; i <= last; ) {
+		uint8_t c = folding[(uint8_t)bytes[i+n-1]];
+		if (c == (uint8_t)needle[n-1] && equal(i)) return i;
+		i += skip[c];
+	}
+	return string::npos;
+}
+
+// Pieces are copied into a window behind whatever bytes the previous piece
+// left unexamined, plus one more so word boundaries can look back. A match
+// ending at the window's edge waits for the next piece, so the byte after
+// it is always known unless the range ends there.
+void Search::scan(const Doc& doc, uint from, uint limit, const function<bool(const Match&)>& fn) const {
+	limit = min(limit, doc.size());
+	if (!valid() || from >= limit) return;
+	if (pattern) return lines(doc, from, limit, fn);
+
+	size_t n = needle.size();
+	string window;
+	// the first start not yet examined, and a byte whose cell is known
+	size_t start = 0;
+	size_t mark = 0;
+	uint cell = from;
+
+	if (from && words) {
+		char bytes[4];
+		window.assign(bytes, UTF8::encode(doc[from-1], bytes));
+		start = mark = window.size();
+	}
+
+	bool done = false;
+
+	auto examine = [&](bool final) {
+		size_t size = window.size();
+		size_t reach = final ? size: size ? size-1: 0;
+		for (size_t s = start; !done && s+n <= reach; ) {
+			size_t hit = find(window.data(), s, reach-n);
+			if (hit == string::npos) break;
+			s = hit+1;
+			if (words && ((hit && word(window[hit-1])) || (hit+n < size && word(window[hit+n])))) continue;
+			cell += cells(window.data()+mark, hit-mark);
+			mark = hit;
+			done = cell >= limit || !fn({cell, cells(window.data()+hit, n)});
+		}
+		if (reach >= n) start = max(start, reach-n+1);
+
+		// mark can sit past keep only inside the character seeded before from
+		size_t keep = start ? start-1: 0;
+		if (keep >= mark) cell += cells(window.data()+mark, keep-mark);
+		else cell -= cells(window.data()+keep, mark-keep);
+		window.erase(0, keep);
+		start -= keep;
+		mark = 0;
+	};
+
+	auto visit = [&](const Doc::Piece& piece, uint first, uint last) {
+		auto bytes = doc.data(piece);
+		size_t a = doc.offset(piece, first);
+		window.append(bytes+a, doc.offset(piece, last)-a);
+		examine(false);
+		return !done;
+	};
+
+	// pieces past the limit plus the needle cannot hold a match starting before it
+	doc.walk(doc.root.get(), 0, from, min((size_t)doc.size(), (size_t)limit+n), visit);
+	if (!done) examine(true);
+}
+
+void Search::lines(const Doc& doc, uint from, uint limit, const function<bool(const Match&)>& fn) const {
+	if (!expression) return;
+	uint offset = doc.line_offset(doc.cursor(from).line);
+	auto in = doc.read(offset);
+	string line;
+	char bytes[4];
+
+	while (offset < limit) {
+		line.clear();
+		uint length = 0;
+		bool newline = false;
+		while (!in.done() && !newline) {
+			auto c = in.next();
+			newline = c == '\n';
+			if (!newline) line.append(bytes, UTF8::encode(c, bytes));
+			length += !newline;
+		}
+
+		// positions only move forward, so cells are counted incrementally
+		size_t byte = 0;
+		uint at = offset;
+		for (auto it = sregex_iterator(line.begin(), line.end(), *expression); it != sregex_iterator(); ++it) {
+			size_t position = it->position();
+			size_t span = it->length();
+			if (!span) continue;
+			at += cells(line.data()+byte, position-byte);
+			byte = position;
+			if (at < from) continue;
+			if (at >= limit) return;
+			if (!fn({at, cells(line.data()+position, span)})) return;
+		}
+
+		if (!newline) break;
+		offset += length+1;
+	}
+}
+
+vector<Search::Match> Search::all(const Doc& doc) const {
+	vector<Match> matches;
+	scan(doc, 0, doc.size(), [&](const Match& match) {
+		matches.push_back(match);
+		return true;
+	});
+	return matches;
+}
+
+optional<Search::Match> Search::next(const Doc& doc, uint from) const {
+	optional<Match> found;
+	auto first = [&](const Match& match) {
+		found = match;
+		return false;
+	};
+	scan(doc, from, doc.size(), first);
+	if (!found) scan(doc, 0, from, first);
+	return found;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "doc.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <functional>
+#include <regex>
+
+// Finds a needle in a Doc in one forward pass.
+//
+// Literal needles are matched against the UTF-8 bytes where the pieces
+// already hold them. Short needles use memchr and longer ones skip ahead
+// Boyer-Moore-Horspool style, with the last few bytes of each piece carried
+// over so that matches can straddle pieces. Folded searches ignore ASCII
+// case. Whole-word searches reject matches that touch a word character.
+// Regular expressions run over each line.
+//
+// Matches come back in order as cell offsets and lengths, and may overlap.
+
+struct Search {
+	struct Match {
+		uint offset = 0;
+		uint length = 0;
+
+		bool operator==(const Match& o) const {
+			return offset == o.offset && length == o.length;
+		}
+	};
+
+	std::string needle;
+	bool fold = false;
+	bool words = false;
+	bool pattern = false;
+	std::shared_ptr<const std::regex> expression;
+
+	Search(const std::string& needle, bool fold = false, bool words = false, bool pattern = false);
+
+	// an empty needle or a pattern that did not compile finds nothing
+	bool valid() const {
+		return needle.size() && (expression || !pattern);
+	}
+
+	// every match
+	std::vector<Match> all(const Doc& doc) const;
+
+	// the first match starting at or after from, else the first before it
+	std::optional<Match> next(const Doc& doc, uint from) const;
+
+	// visit the matches starting within [from,limit) until fn returns false
+	void scan(const Doc& doc, uint from, uint limit, const std::function<bool(const Match&)>& fn) const;
+
+	// internals
+	uint8_t folding[256];
+	uint skip[256];
+
+	size_t find(const char* bytes, size_t from, size_t last) const;
+	void lines(const Doc& doc, uint from, uint limit, const std::function<bool(const Match&)>& fn) const;
+};
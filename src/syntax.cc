@@ -26,21 +26,35 @@ bool Syntax::wordset(const Doc& text, int cursor, const std::set<std::string,std
 	return len > 0 && names.count(std::string_view(pad)) > 0;
 }
 
+// the identifier before cursor, then the indexed words extending it
+std::vector<std::string> Syntax::complete(const Doc& text, const Words& words, int cursor) {
+	int start = cursor;
+	while (isname(get(text, start-1))) --start;
+	if (start == cursor) return {};
+
+	auto prefix = text.extract(start, cursor-start);
+	auto results = words.complete(prefix);
+	results.insert(results.begin(), prefix);
+	return results;
+}
+
 bool Syntax::hintMatchedPair(const Doc& text, int cursor, const ViewRegion& selection, int open, int close) {
 	auto isBalancedPair = [&](int start, int finish) {
 		int count = 1;
 		bool dstring = false;
 		bool sstring = false;
 
+		auto in = text.read(start+1);
+
 		for (int i = start+1; i <= finish; i++) {
-			int c = get(text, i);
+			int c = in.next();
 
 			if (sstring && c == '\'') { sstring = false; continue; }
 			if (dstring && c == '"') { dstring = false; continue; }
 			if (!dstring && c == '\'') sstring = true;
 			if (!sstring && c == '"') dstring = true;
 			if (sstring || dstring) {
-				if (c == '\\') i++;
+				if (c == '\\') { i++; in.next(); }
 				continue;
 			}
 
@@ -71,26 +85,27 @@ bool Syntax::hintMatchedPair(const Doc& text, int cursor, const ViewRegion& sele
 }
 
 std::pair<bool,int> Syntax::tabs(const Doc& text) {
+	bool sol = true;
+	int spaces = 0;
 
-	auto get = [&](int cursor) {
-		return cursor >= 0 && cursor < (int)text.size() ? text[cursor]: 0;
-	};
+	for (auto in = text.read(0);;) {
+		bool done = in.done();
+		int c = in.next();
 
-	auto sol = [&](int cursor) {
-		return cursor <= 0 || get(cursor-1) == '\n';
-	};
+		if (sol && c == ' ') {
+			spaces++;
+			continue;
+		}
 
-	for (int i = 0, l = text.size(); i < l; i++) {
-		if (!sol(i)) continue;
-		if (get(i) == '\t') break;
+		if (sol && !spaces && c == '\t') break;
 
-		if (get(i) == ' ') {
-			int p = i;
-			while (get(p) == ' ') p++;
-			int w = p-i;
-			if (w >= 2 && w <= 8)
-				return std::make_pair(false, w);
-		}
+		if (sol && spaces >= 2 && spaces <= 8)
+			return std::make_pair(false, spaces);
+
+		if (done) break;
+
+		sol = c == '\n';
+		spaces = 0;
 	}
 
 	return std::make_pair(true, 4);
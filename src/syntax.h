@@ -5,6 +5,7 @@ struct Syntax;
 #include <set>
 #include "view.h"
 #include "doc.h"
+#include "words.h"
 #include <cstring>
 #include <cwctype>
 
@@ -35,8 +36,8 @@ struct Syntax {
 	// Identify document tags/symbols/functions/types
 	virtual std::vector<ViewRegion> tags(const Doc& text) = 0;
 
-	// Find autocomplete strings based on cursor position
-	virtual std::vector<std::string> matches(const Doc& text, int cursor) = 0;
+	// Find autocomplete strings based on cursor position: the prefix, then candidates
+	virtual std::vector<std::string> matches(const Doc& text, const Words& words, int cursor) = 0;
 
 	// Token for first cursor position dispayed on screen
 	virtual Syntax::Token first(const Doc& text, int cursor) = 0;
@@ -54,6 +55,9 @@ struct Syntax {
 	int get(const Doc& text, int offset);
 	bool wordset(const Doc& text, int offset, const std::set<std::string, std::less<>>& names);
 
+	// the identifier prefix at cursor completed from a Words index
+	std::vector<std::string> complete(const Doc& text, const Words& words, int cursor);
+
 	// (..(..)..)
 	bool hintMatchedPair(const Doc& text, int cursor, const ViewRegion& selection, int open, int close);
 
@@ -8,7 +8,7 @@ std::vector<ViewRegion> Bash::tags(const Doc& text) {
 	return {};
 }
 
-std::vector<std::string> Bash::matches(const Doc& text, int cursor) {
+std::vector<std::string> Bash::matches(const Doc& text, const Words& words, int cursor) {
 	return {};
 }
 
@@ -8,7 +8,7 @@ std::vector<ViewRegion> CMake::tags(const Doc& text) {
 	return {};
 }
 
-std::vector<std::string> CMake::matches(const Doc& text, int cursor) {
+std::vector<std::string> CMake::matches(const Doc& text, const Words& words, int cursor) {
 	return {};
 }
 
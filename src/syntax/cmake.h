@@ -4,7 +4,7 @@
 
 struct CMake : Syntax {
 	std::vector<ViewRegion> tags(const Doc& text);
-	std::vector<std::string> matches(const Doc& text, int cursor);
+	std::vector<std::string> matches(const Doc& text, const Words& words, int cursor);
 	Token first(const Doc& text, int cursor);
 	Token next(const Doc& text, int cursor, Token token);
 	bool hint(const Doc& text, int cursor, const std::vector<ViewRegion>& selections);
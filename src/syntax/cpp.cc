@@ -31,56 +31,8 @@ std::vector<ViewRegion> CPP::tags(const Doc& text) {
 	return hits;
 }
 
-std::vector<std::string> CPP::matches(const Doc& text, int cursor) {
-	std::set<std::string> hits;
-	std::vector<std::string> results;
-
-	auto c = [&](int offset = 0) {
-		return get(text, cursor+offset);
-	};
-
-	int home = cursor;
-
-	while (isname(c(-1))) --cursor;
-
-	int pstart = cursor;
-	int plength = home-pstart;
-
-	if (pstart < home) {
-		cursor = 0;
-
-		std::vector<int> prefix;
-		for (int i = pstart; i < home; i++) {
-			prefix.push_back(get(text, i));
-		}
-
-		while (cursor < (int)text.size()) {
-			int mstart = cursor;
-			for (int i = 0; i < plength; i++, cursor++) {
-				if (c() != prefix[i]) break;
-			}
-			int mlength = cursor-mstart;
-			if (mlength == plength) {
-				while (isname(c())) cursor++;
-				std::string match;
-				for (int i = mstart; i < cursor; i++) {
-					match += get(text, i);
-				}
-				if ((int)match.size() > mlength) {
-					hits.insert(match);
-				}
-				continue;
-			}
-			cursor++;
-		}
-
-		results.push_back({prefix.begin(), prefix.end()});
-
-		for (auto& hit: hits) {
-			results.push_back(hit);
-		}
-	}
-	return results;
+std::vector<std::string> CPP::matches(const Doc& text, const Words& words, int cursor) {
+	return complete(text, words, cursor);
 }
 
 bool CPP::isoperator(int c) {
@@ -16,7 +16,7 @@ std::vector<ViewRegion> Forth::tags(const Doc& text) {
 	return {};
 }
 
-std::vector<std::string> Forth::matches(const Doc& text, int cursor) {
+std::vector<std::string> Forth::matches(const Doc& text, const Words& words, int cursor) {
 	return {};
 }
 
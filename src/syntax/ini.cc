@@ -13,7 +13,7 @@ std::vector<ViewRegion> INI::tags(const Doc& text) {
 	return tags;
 }
 
-std::vector<std::string> INI::matches(const Doc& text, int cursor) {
+std::vector<std::string> INI::matches(const Doc& text, const Words& words, int cursor) {
 	return {};
 }
 
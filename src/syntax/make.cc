@@ -26,7 +26,7 @@ std::vector<ViewRegion> Make::tags(const Doc& text) {
 	return tags;
 }
 
-std::vector<std::string> Make::matches(const Doc& text, int cursor) {
+std::vector<std::string> Make::matches(const Doc& text, const Words& words, int cursor) {
 	return {};
 }
 
@@ -4,7 +4,7 @@ std::vector<ViewRegion> PlainText::tags(const Doc& text) {
 	return {};
 }
 
-std::vector<std::string> PlainText::matches(const Doc& text, int cursor) {
+std::vector<std::string> PlainText::matches(const Doc& text, const Words& words, int cursor) {
 	return {};
 }
 
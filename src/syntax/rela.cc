@@ -8,7 +8,7 @@ std::vector<ViewRegion> Rela::tags(const Doc& text) {
 	return {};
 }
 
-std::vector<std::string> Rela::matches(const Doc& text, int cursor) {
+std::vector<std::string> Rela::matches(const Doc& text, const Words& words, int cursor) {
 	return {};
 }
 
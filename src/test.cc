@@ -1,19 +1,34 @@
 
 #include "doc.h"
 #include "utf8.h"
+#include "search.h"
+#include "words.h"
 #include "gtest/gtest.h"
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
 
 Doc doc;
 
+// numbered lines shared by the larger doc tests
+static std::string lines(const char* tag, int n) {
+	std::string text;
+	for (int i = 0; i < n; i++) text += std::string(tag) + " " + std::to_string(i) + "\n";
+	return text;
+}
+
 TEST(doc, init) {
 	doc.push_back("abc\ndef");
 	EXPECT_EQ(std::string(doc), "abc\ndef");
 	EXPECT_EQ(doc.size(), 7U);
-	EXPECT_EQ(doc.lines.size(), 2U);
+	EXPECT_EQ(doc.line_count(), 2U);
 	EXPECT_EQ(doc[6], 'f');
-	EXPECT_EQ(doc.last.index, 6U);
-	EXPECT_EQ(doc.last.line, 1U);
-	EXPECT_EQ(doc.last.cell, 2U);
+	auto cur = doc.cursor(6);
+	EXPECT_EQ(cur.index, 6U);
+	EXPECT_EQ(cur.line, 1U);
+	EXPECT_EQ(cur.cell, 2U);
 	EXPECT_TRUE(doc.sanity());
 }
 
@@ -21,31 +36,478 @@ TEST(doc, insert) {
 	doc.insert(doc.begin()+2, 'a');
 	EXPECT_EQ(std::string(doc), "abac\ndef");
 	EXPECT_EQ(doc[2], 'a');
-	EXPECT_EQ(doc.last.index, 2U);
-	EXPECT_EQ(doc.last.line, 0U);
-	EXPECT_EQ(doc.last.cell, 2U);
+	auto cur = doc.cursor(2);
+	EXPECT_EQ(cur.index, 2U);
+	EXPECT_EQ(cur.line, 0U);
+	EXPECT_EQ(cur.cell, 2U);
 	EXPECT_EQ(doc.size(), 8U);
-	EXPECT_EQ(doc.lines.size(), 2U);
+	EXPECT_EQ(doc.line_count(), 2U);
 	EXPECT_TRUE(doc.sanity());
 }
 
 TEST(doc, erase) {
 	EXPECT_EQ(doc[4], '\n');
-	EXPECT_EQ(doc.last.index, 4U);
-	EXPECT_EQ(doc.last.line, 0U);
-	EXPECT_EQ(doc.last.cell, 4U);
+	auto cur = doc.cursor(4);
+	EXPECT_EQ(cur.index, 4U);
+	EXPECT_EQ(cur.line, 0U);
+	EXPECT_EQ(cur.cell, 4U);
 	doc.erase(doc.begin()+4);
-	EXPECT_EQ(doc.last.index, 3U);
-	EXPECT_EQ(doc.last.line, 0U);
-	EXPECT_EQ(doc.last.cell, 3U);
+	cur = doc.cursor(3);
+	EXPECT_EQ(cur.index, 3U);
+	EXPECT_EQ(cur.line, 0U);
+	EXPECT_EQ(cur.cell, 3U);
 	EXPECT_EQ(std::string(doc), "abacdef");
 	EXPECT_EQ(doc[4], 'd');
-	EXPECT_EQ(doc.last.index, 4U);
-	EXPECT_EQ(doc.last.line, 0U);
-	EXPECT_EQ(doc.last.cell, 4U);
+	cur = doc.cursor(4);
+	EXPECT_EQ(cur.index, 4U);
+	EXPECT_EQ(cur.line, 0U);
+	EXPECT_EQ(cur.cell, 4U);
+	EXPECT_EQ(doc.line_count(), 1U);
 	EXPECT_TRUE(doc.sanity());
 }
 
+static uint pieces(const Doc::Node* node) {
+	return node ? 1 + pieces(node->left.get()) + pieces(node->right.get()): 0;
+}
+
+static uint height(const Doc::Node* node) {
+	return node ? 1 + std::max(height(node->left.get()), height(node->right.get())): 0;
+}
+
+TEST(doc, pieces) {
+	std::string text = lines("line", 1000);
+
+	Doc big;
+	big.push_back(text);
+	EXPECT_GT(pieces(big.root.get()), 1U);
+	EXPECT_EQ(big.line_count(), 1001U);
+	EXPECT_EQ(big.line_offset(500), text.find("line 500"));
+	EXPECT_TRUE(big.sanity());
+
+	// typing in the middle splits one piece, further typing extends the insertion
+	uint at = big.line_offset(500)+4;
+	uint before = pieces(big.root.get());
+	big.insert(big.begin()+at, '-');
+	big.insert(big.begin()+at+1, '\n');
+	big.insert(big.begin()+at+2, '-');
+	EXPECT_EQ(pieces(big.root.get()), before+2);
+	text.insert(at, "-\n-");
+	EXPECT_EQ(std::string(big), text);
+	EXPECT_EQ(big.line_count(), 1002U);
+	EXPECT_EQ(big.line_offset(501), at+2);
+
+	auto cur = big.cursor(at+3);
+	EXPECT_EQ(cur.line, 501U);
+	EXPECT_EQ(cur.cell, 1U);
+
+	big.erase(big.begin()+at, 3);
+	text.erase(at, 3);
+	EXPECT_EQ(std::string(big), text);
+	EXPECT_EQ(big.cursor(big.size()).line, 1000U);
+	EXPECT_TRUE(big.sanity());
+
+	// later bulk loads append without copying the original buffer
+	Doc chunked;
+	for (size_t i = 0; i < text.size(); i += 777) chunked.push_back(text.substr(i, 777));
+	EXPECT_EQ(chunked.original->size(), 777U);
+	EXPECT_EQ(std::string(chunked), text);
+	EXPECT_TRUE(chunked.sanity());
+}
+
+TEST(doc, utf8) {
+	std::string text = "héllo 世界\n😀 ok\n";
+
+	Doc doc;
+	doc.push_back(text);
+	EXPECT_EQ(doc.original->size(), text.size());
+	EXPECT_EQ(doc.size(), 14U);
+	EXPECT_EQ(doc[1], 0xe9U);
+	EXPECT_EQ(doc[6], 0x4e16U);
+	EXPECT_EQ(doc[9], 0x1F600U);
+	EXPECT_EQ(doc[7], 0x754cU);
+	EXPECT_EQ(doc.line_offset(1), 9U);
+
+	auto cur = doc.cursor(11);
+	EXPECT_EQ(cur.line, 1U);
+	EXPECT_EQ(cur.cell, 2U);
+
+	EXPECT_EQ(doc.extract((size_t)6, 2), "世界");
+	doc.insert(doc.begin()+2, 0x00fc);
+	doc.erase(doc.begin()+7, 1);
+	EXPECT_EQ(std::string(doc), "héüllo 界\n😀 ok\n");
+	EXPECT_TRUE(doc.sanity());
+
+	// invalid input is repaired on load
+	Doc bad;
+	bad.push_back("a\xff" "b");
+	EXPECT_EQ(std::string(bad), "a?b");
+}
+
+TEST(doc, ranges) {
+	Doc doc;
+	doc.push_back("first\nlast\n");
+
+	std::string paste;
+	for (int i = 0; i < 2000; i++) paste += "pasted é " + std::to_string(i) + "\n";
+
+	// one splice, however many lines
+	doc.insert(doc.begin()+6, paste);
+	EXPECT_EQ(std::string(doc), "first\n" + paste + "last\n");
+	EXPECT_EQ(doc.line_count(), 2003U);
+	EXPECT_LE(pieces(doc.root.get()), 2+paste.size()/Doc::maxPiece+1);
+	EXPECT_TRUE(doc.sanity());
+
+	std::vector<uint32_t> codes = {'a', 0x4e16, '\n'};
+	doc.insert(doc.begin(), codes.begin(), codes.end());
+	EXPECT_EQ(doc.line_offset(1), 3U);
+
+	doc.erase(doc.begin()+9, doc.end()-5);
+	EXPECT_EQ(std::string(doc), "a世\nfirst\nlast\n");
+	EXPECT_EQ(doc.line_count(), 4U);
+	EXPECT_TRUE(doc.sanity());
+}
+
+TEST(doc, mapped) {
+	std::string text = lines("mapped é", 5000);
+
+	auto path = std::filesystem::temp_directory_path() / "sce-test-mapped.txt";
+	std::ofstream(path) << text;
+	auto file = std::make_shared<const Doc::Mapping>(path.string());
+	std::filesystem::remove(path);
+	ASSERT_NE(file->data, nullptr);
+
+	// a preview never cuts a code point
+	Doc window;
+	EXPECT_TRUE(window.map(file, 8));
+	EXPECT_EQ(std::string(window), "mapped ");
+
+	// and can start part way in, as it follows scrolling
+	size_t from = text.find("mapped é 4000");
+	EXPECT_TRUE(window.map(file, 1000, from));
+	std::string part = window;
+	EXPECT_LE(part.size(), 1000U);
+	EXPECT_GE(part.size(), 997U);
+	EXPECT_EQ(part, text.substr(from, part.size()));
+	EXPECT_EQ(window.line_offset(1), text.find("mapped é 4001")-from-1);
+	window.insert(window.begin(), '>');
+	EXPECT_EQ(window.extract(0, 14), ">mapped é 4000");
+	EXPECT_TRUE(window.sanity());
+	EXPECT_FALSE(window.map(file, 8, text.find("é")+1));
+
+	Doc doc;
+	EXPECT_TRUE(doc.map(file));
+	EXPECT_TRUE(doc.mapped());
+	EXPECT_FALSE(doc.original);
+	EXPECT_EQ(std::string(doc), text);
+	EXPECT_EQ(doc.line_count(), 5001U);
+	EXPECT_TRUE(doc.sanity());
+
+	// the first edit takes a private copy
+	doc.insert(doc.begin(), '>');
+	EXPECT_FALSE(doc.mapped());
+	EXPECT_EQ(std::string(doc), ">" + text);
+	EXPECT_TRUE(doc.sanity());
+}
+
+TEST(doc, save) {
+	std::string text = lines("saved é", 300000);
+
+	auto dir = std::filesystem::temp_directory_path() / "sce-test-save";
+	std::filesystem::create_directories(dir);
+	auto path = dir / "saved.txt";
+	std::ofstream(path) << "old";
+	std::filesystem::permissions(path, std::filesystem::perms::owner_read|std::filesystem::perms::owner_write|std::filesystem::perms::group_read);
+
+	// enough pieces to need several gathered writes
+	Doc doc;
+	doc.push_back(text);
+	doc.insert(doc.begin()+10, std::string("inserted"));
+	doc.erase(doc.begin()+text.size()/2, 100);
+	ASSERT_GT(doc.root->cells/Doc::maxPiece, 1024U);
+	EXPECT_TRUE(doc.save(path.string(), false));
+
+	std::stringstream saved;
+	saved << std::ifstream(path).rdbuf();
+	EXPECT_EQ(saved.str(), std::string(doc));
+	EXPECT_EQ(std::filesystem::status(path).permissions(), std::filesystem::perms::owner_read|std::filesystem::perms::owner_write|std::filesystem::perms::group_read);
+
+	// links are written through rather than replaced
+	std::filesystem::create_symlink(path, dir / "link");
+	std::filesystem::create_hard_link(path, dir / "hard");
+	Doc small;
+	small.push_back("linked\n");
+	EXPECT_TRUE(small.save((dir / "link").string(), false));
+	EXPECT_TRUE(std::filesystem::is_symlink(dir / "link"));
+	std::stringstream linked;
+	linked << std::ifstream(dir / "hard").rdbuf();
+	EXPECT_EQ(linked.str(), "linked\n");
+	small.insert(small.end(), 'x');
+	EXPECT_TRUE(small.save((dir / "hard").string(), false));
+	EXPECT_TRUE(std::filesystem::equivalent(path, dir / "hard"));
+	std::stringstream both;
+	both << std::ifstream(path).rdbuf();
+	EXPECT_EQ(both.str(), "linked\nx");
+	std::filesystem::remove(dir / "link");
+	std::filesystem::remove(dir / "hard");
+
+	// a writable file in a directory we can't create in is written in place
+	// (root creates anyway, and takes the usual path)
+	auto locked = dir / "locked";
+	std::filesystem::create_directories(locked);
+	std::ofstream(locked / "file") << "before";
+	std::filesystem::permissions(locked, std::filesystem::perms::owner_write, std::filesystem::perm_options::remove);
+	EXPECT_TRUE(small.save((locked / "file").string(), false));
+	std::stringstream inplace;
+	inplace << std::ifstream(locked / "file").rdbuf();
+	EXPECT_EQ(inplace.str(), "linked\nx");
+	if (geteuid()) {
+		EXPECT_FALSE(small.save((locked / "missing").string(), false));
+	}
+	std::filesystem::permissions(locked, std::filesystem::perms::owner_write, std::filesystem::perm_options::add);
+	std::filesystem::remove_all(locked);
+
+	// no temporary left behind when the rename fails
+	std::filesystem::create_directories(dir / "taken");
+	EXPECT_FALSE(doc.save((dir / "taken").string(), false));
+	EXPECT_EQ(std::distance(std::filesystem::directory_iterator(dir), std::filesystem::directory_iterator()), 2);
+
+	std::filesystem::remove_all(dir);
+}
+
+TEST(doc, spans) {
+	std::string text = lines("span é", 3000);
+
+	Doc doc;
+	doc.push_back(text);
+	auto codes = UTF8(text).codes;
+
+	std::vector<uint32_t> seen;
+	uint spans = 0;
+	doc.for_each_span(5, doc.size(), [&](auto span) {
+		seen.insert(seen.end(), span.begin(), span.end());
+		spans++;
+		return true;
+	});
+	EXPECT_EQ(seen, std::vector<uint32_t>(codes.begin()+5, codes.end()));
+	EXPECT_EQ(spans, pieces(doc.root.get()));
+
+	// stopping early
+	spans = 0;
+	doc.for_each_span(0, doc.size(), [&](auto span) { return ++spans < 2; });
+	EXPECT_EQ(spans, 2U);
+
+	seen.clear();
+	for (auto in = doc.read(5); !in.done(); ) seen.push_back(in.next());
+	EXPECT_EQ(seen, std::vector<uint32_t>(codes.begin()+5, codes.end()));
+	EXPECT_EQ(doc.read(doc.size()).next(), 0U);
+}
+
+TEST(doc, snapshots) {
+	std::string text = lines("snap", 2000);
+
+	Doc doc;
+	doc.push_back(text);
+	doc.insert(doc.begin()+5, 'x');
+
+	auto snap = doc.snapshot();
+	EXPECT_EQ(snap->root, doc.root);
+
+	// edits copy only the nodes they touch, and both sides keep typing
+	Doc fork = doc;
+	for (int i = 0; i < 100; i++) {
+		doc.insert(doc.begin()+6+i, 'y');
+		fork.insert(fork.begin()+6+i, 'z');
+	}
+	doc.erase(doc.begin()+text.size()/2, 1000);
+	EXPECT_NE(snap->root, doc.root);
+
+	std::string expect = text;
+	expect.insert(5, "x");
+	EXPECT_EQ(std::string(*snap), expect);
+	EXPECT_EQ(std::string(fork), expect.substr(0, 6) + std::string(100, 'z') + expect.substr(6));
+	EXPECT_EQ(doc.size(), expect.size()+100-1000);
+	EXPECT_TRUE(snap->sanity());
+	EXPECT_TRUE(fork.sanity());
+	EXPECT_TRUE(doc.sanity());
+}
+
+// Snapshots are dropped on other threads while the owner edits the nodes
+// they shared. Build with -fsanitize=thread to check the ownership test.
+TEST(doc, release) {
+	std::string text = lines("release", 2000);
+	Doc doc;
+	doc.push_back(text);
+	uint cells = doc.size();
+
+	for (int round = 0; round < 20; round++) {
+		auto snap = doc.snapshot();
+		std::thread reader([snap=std::move(snap), cells]() mutable {
+			EXPECT_EQ(snap->size(), cells);
+			snap.reset();
+		});
+		for (uint i = 0; i < 200; i++) doc.insert(doc.begin()+(i*7919)%doc.size(), 'x');
+		for (uint i = 0; i < 200; i++) doc.erase(doc.begin()+(i*7919)%(doc.size()-1), 1);
+		reader.join();
+	}
+	EXPECT_EQ(doc.size(), cells);
+	EXPECT_TRUE(doc.sanity());
+}
+
+TEST(doc, journal) {
+	Doc doc;
+	doc.push_back("hello\nworld\n");
+	auto base = doc.version;
+	Doc before = doc;
+
+	doc.insert(doc.begin()+5, ',');
+	doc.insert(doc.begin()+6, ' ');
+	doc.insert(doc.begin()+7, std::string("big"));
+	doc.erase(doc.begin(), 2);
+	EXPECT_EQ(doc.version, base+4);
+	EXPECT_TRUE(doc.recent(base));
+
+	std::vector<Doc::Change> expect = {{5,0,1}, {6,0,1}, {7,0,3}, {0,2,0}};
+	EXPECT_EQ(doc.changes(base), expect);
+	EXPECT_TRUE(doc.changes(doc.version).empty());
+
+	// a position tracked through the changes lands on the same character
+	uint position = 7;
+	EXPECT_EQ(before[position], 'o');
+	for (auto& change: doc.changes(base)) position = change.shift(position);
+	EXPECT_EQ(position, 10U);
+	EXPECT_EQ(doc[position], 'o');
+
+	// snapshots keep the version but not the history
+	auto snap = doc.snapshot();
+	EXPECT_EQ(snap->version, doc.version);
+	EXPECT_FALSE(snap->recent(base));
+
+	// assignment replaces everything
+	Doc other;
+	other.push_back("x");
+	auto size = doc.size();
+	doc = other;
+	expect = {{0,size,1}};
+	EXPECT_EQ(doc.changes(doc.version-1), expect);
+
+	// the journal is bounded
+	for (uint i = 0; i < Doc::journalLimit+10; i++) doc.insert(doc.end(), 'x');
+	EXPECT_FALSE(doc.recent(base));
+	EXPECT_TRUE(doc.recent(doc.version-Doc::journalLimit));
+	EXPECT_FALSE(doc.recent(doc.version-Doc::journalLimit-1));
+	EXPECT_EQ(doc.changes(doc.version-3).size(), 3U);
+}
+
+TEST(doc, regions) {
+	Doc doc;
+	doc.push_back("0123456789");
+	auto since = doc.version;
+	doc.insert(doc.begin()+2, std::string("ab"));
+	doc.erase(doc.begin()+8, 2);
+	doc.insert(doc.begin()+3, 'c');
+	auto regions = doc.regions(since);
+	ASSERT_EQ(regions.size(), 2U);
+	EXPECT_EQ(regions[0].offset, 2U);
+	EXPECT_EQ(regions[0].length, 3U);
+	EXPECT_EQ(regions[0].removed, 0U);
+	EXPECT_EQ(regions[1].offset, 9U);
+	EXPECT_EQ(regions[1].length, 0U);
+	EXPECT_EQ(regions[1].removed, 2U);
+
+	// a change spanning both joins them
+	doc.erase(doc.begin()+4, 5);
+	regions = doc.regions(since);
+	ASSERT_EQ(regions.size(), 1U);
+	EXPECT_EQ(regions[0].offset, 2U);
+	EXPECT_EQ(regions[0].length, 2U);
+	EXPECT_EQ(regions[0].removed, 6U);
+	EXPECT_EQ(std::string(doc), "01ac89");
+}
+
+TEST(doc, hash) {
+	std::string text = lines("hash é", 3000);
+
+	Doc doc;
+	doc.push_back(text);
+	EXPECT_EQ(doc.hash(), Doc::hash(text.data(), text.size()));
+	EXPECT_NE(Doc().hash(), doc.hash());
+
+	// the same text reached by edits hashes the same however it is split
+	auto original = doc.hash();
+	doc.insert(doc.begin()+10, 'x');
+	doc.insert(doc.begin()+11, std::string("yz\n"));
+	EXPECT_NE(doc.hash(), original);
+	doc.erase(doc.begin()+10, 4);
+	EXPECT_EQ(doc.hash(), original);
+	EXPECT_TRUE(doc.sanity());
+
+	Doc typed;
+	for (auto c: UTF8(text.substr(0, 5000)).codes) typed.insert(typed.end(), c);
+	Doc loaded;
+	loaded.push_back(text.substr(0, 5000));
+	EXPECT_EQ(typed.hash(), loaded.hash());
+	EXPECT_TRUE(typed == loaded);
+}
+
+TEST(doc, balance) {
+	Doc big;
+	for (int i = 0; i < 20000; i++) {
+		big.insert(big.begin()+(i*7919)%(big.size()+1), i%10 ? 'x': '\n');
+	}
+	EXPECT_EQ(big.size(), 20000U);
+	EXPECT_EQ(big.line_count(), 2001U);
+	EXPECT_TRUE(big.sanity());
+	EXPECT_LT(height(big.root.get()), 64U);
+
+	for (uint line = 0; line < big.line_count(); line += 97) {
+		uint offset = big.line_offset(line);
+		EXPECT_TRUE(!offset || big[offset-1] == '\n');
+		EXPECT_EQ(big.cursor(offset).line, line);
+		EXPECT_EQ(big.cursor(offset).cell, 0U);
+	}
+
+	// cutting one loaded piece again and again from the right
+	Doc cut;
+	cut.push_back(std::string(20000, 'x'));
+	for (int i = 19990; i > 0; i -= 10) cut.erase(cut.begin()+i, 1);
+	EXPECT_TRUE(cut.sanity());
+	EXPECT_LT(height(cut.root.get()), 64U);
+}
+
+TEST(doc, patch) {
+	std::string text = lines("patch é", 2000);
+
+	for (int count: {3, 500}) {
+		Doc doc;
+		doc.push_back(text);
+		auto codes = UTF8(text).codes;
+		std::vector<Doc::Patch> patches;
+		std::vector<uint32_t> expect;
+		uint at = 0;
+		for (int i = 0; i < count; i++) {
+			uint offset = (uint)((uint64_t)codes.size()*i/count) + (i%3 == 0);
+			uint removed = std::min<uint>(i%5, codes.size()-offset);
+			std::string insert = i%2 ? "ü"+std::to_string(i): "";
+			expect.insert(expect.end(), codes.begin()+at, codes.begin()+offset);
+			auto inserted = UTF8(insert).codes;
+			expect.insert(expect.end(), inserted.begin(), inserted.end());
+			at = offset+removed;
+			patches.push_back({offset, removed, insert});
+		}
+		expect.insert(expect.end(), codes.begin()+at, codes.end());
+		patches.push_back({(uint)codes.size(), 0, "end"});
+		for (auto c: UTF8("end").codes) expect.push_back(c);
+
+		auto version = doc.version;
+		doc.patch(patches);
+		EXPECT_TRUE(doc.sanity());
+		EXPECT_EQ((std::string)doc, UTF8(expect).text);
+		EXPECT_EQ(doc.hash(), Doc::hash(((std::string)doc).data(), ((std::string)doc).size()));
+		EXPECT_GT(doc.version, version);
+		EXPECT_LT(height(doc.root.get()), 64U);
+	}
+}
+
 TEST(UTF8Constructor, DecodeValidUTF8) {
     UTF8 utf8_input("Hello, 世界!"); // UTF-8 string with ASCII and non-ASCII characters
 
@@ -87,3 +549,175 @@ TEST(UTF8Constructor, EncodeInvalidCodePoints) {
     EXPECT_EQ(utf8_input.encodeErrors.size(), 1);
 }
 
+
+TEST(UTF8Validate, ErrorPositions) {
+    std::string text(100, 'a');
+    text += "世界";
+    EXPECT_EQ(UTF8::validate(text.data(), text.size()), text.size());
+
+    text[70] = static_cast<char>(0x80); // stray continuation inside a vector block
+    EXPECT_EQ(UTF8::validate(text.data(), text.size()), 70U);
+
+    std::string truncated = std::string(40, 'b') + "\xE4\xB8";
+    EXPECT_EQ(UTF8::validate(truncated.data(), truncated.size()), 40U);
+}
+
+TEST(UTF8Constructor, RoundTripLongRuns) {
+    std::string text;
+    for (int i = 0; i < 300; i++) text += i%37 ? std::string(1, 'a'+i%26): "é世😀";
+
+    UTF8 decoded(text);
+    EXPECT_TRUE(decoded.ok());
+    EXPECT_EQ(decoded.codes.size(), 300U+9U*2U);
+    EXPECT_EQ(UTF8(decoded.codes).text, text);
+
+    size_t at = text.size();
+    text += static_cast<char>(0xFF);
+    text += std::string(40, 'z');
+    UTF8 invalid(text);
+    EXPECT_EQ(invalid.decodeErrors, std::vector<size_t>{at});
+    EXPECT_EQ(invalid.codes.size(), 318U+1U+40U);
+}
+
+// matches found by comparing code points at every offset
+static std::vector<Search::Match> naive(const std::vector<uint32_t>& text, const std::vector<uint32_t>& needle, bool fold, bool words) {
+	auto word = [](uint32_t c) { return c >= 0x80 || isalnum(c) || c == '_'; };
+	auto low = [&](uint32_t c) { return fold && c < 0x80 ? (uint32_t)tolower(c): c; };
+	std::vector<Search::Match> matches;
+	for (size_t i = 0; i+needle.size() <= text.size(); i++) {
+		bool match = true;
+		for (size_t j = 0; j < needle.size() && match; j++) match = low(text[i+j]) == low(needle[j]);
+		if (match && words && ((i && word(text[i-1])) || (i+needle.size() < text.size() && word(text[i+needle.size()])))) match = false;
+		if (match) matches.push_back({(uint)i, (uint)needle.size()});
+	}
+	return matches;
+}
+
+TEST(search, literal) {
+	std::string text;
+	for (int i = 0; i < 4000; i++) text += i%7 ? "needle ": i%5 ? "Needle\n": "néedle_needle世 ";
+
+	// fragment the pieces so matches straddle them
+	Doc doc;
+	doc.push_back(text);
+	for (uint i = 1; i < 200; i++) {
+		doc.insert(doc.begin()+i*97, 'x');
+		doc.erase(doc.begin()+i*97, 1);
+	}
+	auto codes = UTF8(text).codes;
+
+	for (std::string needle: {"n", "ne", "needle", "Needle", "le n", "édle", "世", "dle_nee", "needle世 "}) {
+		auto expect = naive(codes, UTF8(needle).codes, false, false);
+		EXPECT_EQ(Search(needle).all(doc), expect) << needle;
+		EXPECT_EQ(Search(needle, true).all(doc), naive(codes, UTF8(needle).codes, true, false)) << needle;
+		EXPECT_EQ(Search(needle, false, true).all(doc), naive(codes, UTF8(needle).codes, false, true)) << needle;
+
+		// partial ranges see the same matches
+		std::vector<Search::Match> part;
+		Search(needle).scan(doc, 1000, 3000, [&](auto& match) { part.push_back(match); return true; });
+		std::vector<Search::Match> within;
+		for (auto& match: expect) if (match.offset >= 1000 && match.offset < 3000) within.push_back(match);
+		EXPECT_EQ(part, within) << needle;
+	}
+
+	EXPECT_TRUE(Search("").all(doc).empty());
+	EXPECT_TRUE(Search("absent").all(doc).empty());
+	EXPECT_EQ(Search("needle").next(doc, 5)->offset, 7U);
+	EXPECT_EQ(Search("néedle").next(doc, doc.size()-3)->offset, 0U);
+}
+
+TEST(search, pattern) {
+	Doc doc;
+	doc.push_back("int a = 1;\nint ab = 22;\nfloat é = 333;\n");
+
+	auto offsets = [&](const Search& search) {
+		std::vector<uint> offsets;
+		for (auto& match: search.all(doc)) offsets.push_back(match.offset);
+		return offsets;
+	};
+
+	EXPECT_EQ(offsets(Search("[0-9]+", false, false, true)), (std::vector<uint>{8, 20, 34}));
+	EXPECT_EQ(Search("[0-9]+", false, false, true).all(doc)[2].length, 3U);
+	EXPECT_EQ(offsets(Search("A", true, true, true)), std::vector<uint>{4});
+	EXPECT_EQ(offsets(Search("^int", false, false, true)), (std::vector<uint>{0, 11}));
+	EXPECT_FALSE(Search("(", false, false, true).valid());
+	EXPECT_TRUE(Search("(", false, false, true).all(doc).empty());
+}
+
+TEST(words, complete) {
+	Doc doc;
+	doc.push_back("int alpha = alphabet+alpha_2;\nfloat beta = alp;\n");
+	Words words;
+	words.update(doc);
+	EXPECT_EQ(words.counts.at("alpha"), 1U);
+	EXPECT_EQ(words.complete("alp"), (std::vector<std::string>{"alpha", "alpha_2", "alphabet"}));
+	EXPECT_EQ(words.complete("alpha_"), std::vector<std::string>{"alpha_2"});
+	EXPECT_TRUE(words.complete("gamma").empty());
+
+	// splitting and joining words at the edges of an edit
+	doc.insert(doc.begin()+6, ' ');
+	doc.erase(doc.begin()+29, 2);
+	words.update(doc);
+	EXPECT_EQ(words.counts.count("alpha"), 0U);
+	EXPECT_EQ(words.counts.at("al"), 1U);
+	EXPECT_EQ(words.counts.at("pha"), 1U);
+	EXPECT_EQ(words.counts.count("alpha_2"), 0U);
+	EXPECT_EQ(words.counts.at("alpha_2float"), 1U);
+}
+
+TEST(words, update) {
+	srand(7);
+	const char* alphabet = "ab_c1 \n.";
+	Doc doc;
+	for (int i = 0; i < 2000; i++) doc.push_back(alphabet[rand()%9]);
+	Words words;
+	words.update(doc);
+	// kept from snapshots, whose journals are empty, as the project indexer does
+	Words shadow;
+	shadow.rebuild(*doc.snapshot());
+
+	for (int round = 0; round < 200; round++) {
+		auto since = doc.version;
+		for (int edits = rand()%20; edits > 0; edits--) {
+			uint at = rand()%(doc.size()+1);
+			if (rand()%2 && at < doc.size()) doc.erase(doc.begin()+at, std::min(doc.size()-at, (uint)rand()%8));
+			for (int n = rand()%6; n > 0; n--) doc.insert(doc.begin()+at, alphabet[rand()%9]);
+		}
+		// outrunning the journal falls back to a recount
+		if (round == 100) for (uint i = 0; i < Doc::journalLimit+1; i++) doc.insert(doc.begin(), 'a');
+
+		words.update(doc);
+		Words fresh;
+		fresh.rebuild(doc);
+		ASSERT_EQ(words.counts, fresh.counts) << round;
+
+		if (doc.recent(since)) shadow.patch(*doc.snapshot(), doc.regions(since)); else shadow.rebuild(*doc.snapshot());
+		ASSERT_EQ(shadow.counts, fresh.counts) << round;
+	}
+}
+
+TEST(words, lexicon) {
+	Lexicon lexicon;
+	lexicon.assign("a.cc", {{"value", 3}, {"valid", 1}, {"other", 2}}, 1);
+	lexicon.assign("b.cc", {{"valid", 4}, {"variant", 1}}, 1);
+	EXPECT_EQ(lexicon.complete("va", 10), (std::vector<std::string>{"valid", "value", "variant"}));
+	EXPECT_EQ(lexicon.complete("va", 1), std::vector<std::string>{"valid"});
+	EXPECT_TRUE(lexicon.complete("valid", 10).empty());
+	EXPECT_TRUE(lexicon.fresh("a.cc", 1));
+	EXPECT_FALSE(lexicon.fresh("a.cc", 2));
+
+	// replacing a file adjusts the totals
+	lexicon.assign("b.cc", {{"variant", 9}}, 2);
+	EXPECT_EQ(lexicon.complete("va", 10), (std::vector<std::string>{"variant", "value", "valid"}));
+
+	// pinned words shadow disk updates until unpinned
+	lexicon.pin("a.cc", {{"vast", 1}});
+	lexicon.assign("a.cc", {{"value", 3}}, 3);
+	EXPECT_EQ(lexicon.complete("va", 10), (std::vector<std::string>{"variant", "vast"}));
+	EXPECT_TRUE(lexicon.fresh("a.cc", 3));
+	lexicon.unpin("a.cc");
+	EXPECT_FALSE(lexicon.fresh("a.cc", 3));
+
+	lexicon.retain({"a.cc"});
+	EXPECT_EQ(lexicon.complete("va", 10), std::vector<std::string>{"vast"});
+}
@@ -3,92 +3,150 @@
 
 using namespace std;
 
-const uint8_t UTF8_2 = 0b11000000;
-const uint8_t UTF8_2_MASK = 0b11100000;
-const uint8_t UTF8_2_PAYLOAD = 0b00011111;
-const uint8_t UTF8_3 = 0b11100000;
-const uint8_t UTF8_3_MASK = 0b11110000;
-const uint8_t UTF8_3_PAYLOAD = 0b00001111;
-const uint8_t UTF8_4 = 0b11110000;
-const uint8_t UTF8_4_MASK = 0b11111000;
-const uint8_t UTF8_4_PAYLOAD = 0b00000111;
-const uint8_t UTF8_MARKER = 0b10000000;
-const uint8_t UTF8_PAYLOAD = 0b00111111;
-
 bool UTF8::ok() const {
 	return encodeErrors.size() == 0 && decodeErrors.size() == 0;
 }
 
-UTF8::UTF8(const string& in) {
-	text = in;
-	size_t cursor = 0;
-
-	auto remaining = [&]() {
-		return in.size() > cursor ? in.size()-cursor: 0u;
-	};
-
-	auto more = [&]() {
-		return remaining() > 0;
-	};
+// Vectorised helpers for runs of ASCII, the bulk of most source text. AVX2
+// is used when the CPU has it, SSE2 otherwise, then scalar for the rest.
 
-	auto next = [&]() {
-		return (uint8_t)in[cursor++];
-	};
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define UTF8_X86 1
+#include <immintrin.h>
 
-	auto peek = [&](size_t offset) {
-		return (uint8_t)(remaining() >= offset ? in[cursor+offset]: 0);
-	};
+__attribute__((target("avx2")))
+static size_t ascii_avx2(const uint8_t* s, size_t n) {
+	size_t i = 0;
+	for (; i+32 <= n; i += 32) {
+		uint mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)(s+i)));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+	return i;
+}
 
-	auto continuations = [&](size_t n) {
-		for (size_t i = 0; i < n; i++)
-			if ((peek(i) & ~UTF8_PAYLOAD) != UTF8_MARKER) return false;
-		return true;
-	};
+__attribute__((target("avx2")))
+static void widen_avx2(const uint8_t* s, size_t n, uint32_t* out) {
+	for (size_t i = 0; i+8 <= n; i += 8) {
+		auto v = _mm_loadl_epi64((const __m128i*)(s+i));
+		_mm256_storeu_si256((__m256i*)(out+i), _mm256_cvtepu8_epi32(v));
+	}
+}
 
-	int errors = 0;
+static bool avx2() {
+	static bool has = __builtin_cpu_supports("avx2");
+	return has;
+}
+#endif
+
+// length of the leading run of ASCII bytes
+static size_t ascii(const uint8_t* s, size_t n) {
+	size_t i = 0;
+#ifdef UTF8_X86
+	if (avx2()) {
+		i = ascii_avx2(s, n);
+		if (i+32 <= n) return i;
+	}
+	for (; i+16 <= n; i += 16) {
+		uint mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(s+i)));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+#endif
+	while (i < n && s[i] < 0x80) i++;
+	return i;
+}
 
-	while (more()) {
-		auto ch = next();
+// ASCII bytes to code points
+static void widen(const uint8_t* s, size_t n, uint32_t* out) {
+	size_t i = 0;
+#ifdef UTF8_X86
+	if (avx2()) {
+		widen_avx2(s, n, out);
+		i = n & ~(size_t)7;
+	}
+	auto zero = _mm_setzero_si128();
+	for (; i+16 <= n; i += 16) {
+		auto v = _mm_loadu_si128((const __m128i*)(s+i));
+		auto lo = _mm_unpacklo_epi8(v, zero);
+		auto hi = _mm_unpackhi_epi8(v, zero);
+		_mm_storeu_si128((__m128i*)(out+i+0), _mm_unpacklo_epi16(lo, zero));
+		_mm_storeu_si128((__m128i*)(out+i+4), _mm_unpackhi_epi16(lo, zero));
+		_mm_storeu_si128((__m128i*)(out+i+8), _mm_unpacklo_epi16(hi, zero));
+		_mm_storeu_si128((__m128i*)(out+i+12), _mm_unpackhi_epi16(hi, zero));
+	}
+#endif
+	for (; i < n; i++) out[i] = s[i];
+}
 
-		if (ch < 0x7F) {
-			codes.push_back(ch);
-			continue;
-		}
+// leading run of ASCII code points to bytes, returns the run length
+static size_t narrow(const uint32_t* s, size_t n, char* out) {
+	size_t i = 0;
+#ifdef UTF8_X86
+	auto high = _mm_set1_epi32(~0x7F);
+	auto zero = _mm_setzero_si128();
+	for (; i+16 <= n; i += 16) {
+		auto a = _mm_loadu_si128((const __m128i*)(s+i+0));
+		auto b = _mm_loadu_si128((const __m128i*)(s+i+4));
+		auto c = _mm_loadu_si128((const __m128i*)(s+i+8));
+		auto d = _mm_loadu_si128((const __m128i*)(s+i+12));
+		auto any = _mm_and_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)), high);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(any, zero)) != 0xFFFF) break;
+		auto packed = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+		_mm_storeu_si128((__m128i*)(out+i), packed);
+	}
+#endif
+	for (; i < n && s[i] <= 0x7F; i++) out[i] = s[i];
+	return i;
+}
 
-		if ((ch & UTF8_4_MASK) == UTF8_4 && continuations(3)) {
-			uint32_t a, b, c, d;
-			a = (ch & UTF8_4_PAYLOAD);
-			b = (next() & UTF8_PAYLOAD);
-			c = (next() & UTF8_PAYLOAD);
-			d = (next() & UTF8_PAYLOAD);
-			uint32_t code = (a<<18) | (b<<12) | (c<<6) | d;
-			codes.push_back(code);
-			continue;
-		}
+// bytes in a valid multi-byte sequence starting at s[0], or 0
+static int sequence(const uint8_t* s, size_t n) {
+	int w = UTF8::width(s[0]);
+	if (w == 1 || n < (size_t)w) return 0;
+	for (int j = 1; j < w; j++)
+		if (!UTF8::continuation(s[j])) return 0;
+	return w;
+}
 
-		if ((ch & UTF8_3_MASK) == UTF8_3 && continuations(2)) {
-			uint32_t a, b, c;
-			a = (ch & UTF8_3_PAYLOAD);
-			b = (next() & UTF8_PAYLOAD);
-			c = (next() & UTF8_PAYLOAD);
-			uint32_t code = (a<<12) | (b<<6) | c;
-			codes.push_back(code);
-			continue;
-		}
+size_t UTF8::validate(const char* in, size_t length) {
+	auto s = (const uint8_t*)in;
+	for (size_t i = 0; ; ) {
+		i += ascii(s+i, length-i);
+		if (i >= length) return length;
+		int w = sequence(s+i, length-i);
+		if (!w) return i;
+		i += w;
+	}
+}
 
-		if ((ch & UTF8_2_MASK) == UTF8_2 && continuations(1)) {
-			uint32_t a, b;
-			a = (ch & UTF8_2_PAYLOAD);
-			b = (next() & UTF8_PAYLOAD);
-			uint32_t code = (a<<6) | b;
-			codes.push_back(code);
+UTF8::UTF8(const string& in) {
+	text = in;
+	auto s = (const uint8_t*)in.data();
+	size_t n = in.size();
+
+	// never more code points than bytes
+	codes.resize(n);
+	size_t out = 0;
+
+	for (size_t i = 0; i < n; ) {
+		size_t run = ascii(s+i, n-i);
+		widen(s+i, run, codes.data()+out);
+		out += run;
+		i += run;
+		if (i >= n) break;
+
+		int w = sequence(s+i, n-i);
+		if (!w) {
+			decodeErrors.push_back(i);
+			codes[out++] = '?';
+			i++;
 			continue;
 		}
-
-		decodeErrors.push_back(cursor-1);
-		codes.push_back('?');
+		codes[out++] = decode(in.data()+i);
+		i += w;
 	}
 
+	codes.resize(out);
+
 	if (decodeErrors.size())
 		cout << "invalid UTF8 decode" << endl;
 }
@@ -96,49 +154,22 @@ UTF8::UTF8(const string& in) {
 UTF8::UTF8(const vector<uint32_t>& in) {
 	codes = in;
 
-	for (size_t cursor = 0; cursor < in.size(); cursor++) {
-		auto co = in[cursor];
+	size_t bytes = 0;
+	for (auto co: in) bytes += co <= 0x7F ? 1: co <= 0x7FF ? 2: co <= 0xFFFF ? 3: co <= 0x10FFFF ? 4: 1;
+	text.resize(bytes);
 
-		if (co <= 0x7F) {
-			text.push_back((char)co);
-			continue;
-		}
-
-		if (co <= 0x7FF) {
-			uint32_t a, b;
-			b = co & UTF8_PAYLOAD;
-			a = (co>>6) & UTF8_2_PAYLOAD;
-			text.push_back(a | UTF8_2);
-			text.push_back(b | UTF8_MARKER);
-			continue;
-		}
+	char* out = text.data();
+	size_t o = 0;
 
-		if (co <= 0xFFFF) {
-			uint32_t a, b, c;
-			c = co & UTF8_PAYLOAD;
-			b = (co>>6) & UTF8_PAYLOAD;
-			a = (co>>12) & UTF8_3_PAYLOAD;
-			text.push_back(a | UTF8_3);
-			text.push_back(b | UTF8_MARKER);
-			text.push_back(c | UTF8_MARKER);
-			continue;
-		}
-
-		if (co <= 0x10FFFF) {
-			uint32_t a, b, c, d;
-			d = co & UTF8_PAYLOAD;
-			c = (co>>6) & UTF8_PAYLOAD;
-			b = (co>>12) & UTF8_PAYLOAD;
-			a = (co>>18) & UTF8_4_PAYLOAD;
-			text.push_back(a | UTF8_4);
-			text.push_back(b | UTF8_MARKER);
-			text.push_back(c | UTF8_MARKER);
-			text.push_back(d | UTF8_MARKER);
-			continue;
-		}
+	for (size_t i = 0, n = in.size(); i < n; ) {
+		size_t run = narrow(in.data()+i, n-i, out+o);
+		i += run;
+		o += run;
+		if (i >= n) break;
 
-		encodeErrors.push_back(cursor);
-		text.push_back('?');
+		if (in[i] > 0x10FFFF) encodeErrors.push_back(i);
+		o += encode(in[i], out+o);
+		i++;
 	}
 
 	if (encodeErrors.size())
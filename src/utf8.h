@@ -14,7 +14,62 @@ struct UTF8 {
 	UTF8(const std::string& in);
 	UTF8(const std::vector<uint32_t>& in);
 
+	// offset of the first invalid sequence, or length when all valid
+	static size_t validate(const char* in, size_t length);
+
 	operator std::string() const {
 		return text;
 	}
+
+	// Single code point helpers for text already known to be valid
+
+	static int width(uint8_t lead) {
+		if (lead < 0x80) return 1;
+		if ((lead & 0xE0) == 0xC0) return 2;
+		if ((lead & 0xF0) == 0xE0) return 3;
+		if ((lead & 0xF8) == 0xF0) return 4;
+		return 1;
+	}
+
+	static bool continuation(uint8_t c) {
+		return (c & 0xC0) == 0x80;
+	}
+
+	static uint32_t decode(const char* in) {
+		auto s = (const uint8_t*)in;
+		switch (width(s[0])) {
+			case 2: return ((s[0] & 0x1F)<<6) | (s[1] & 0x3F);
+			case 3: return ((s[0] & 0x0F)<<12) | ((s[1] & 0x3F)<<6) | (s[2] & 0x3F);
+			case 4: return ((s[0] & 0x07)<<18) | ((s[1] & 0x3F)<<12) | ((s[2] & 0x3F)<<6) | (s[3] & 0x3F);
+		}
+		return s[0];
+	}
+
+	// returns bytes written to out[0..3]
+	static int encode(uint32_t co, char* out) {
+		if (co <= 0x7F) {
+			out[0] = co;
+			return 1;
+		}
+		if (co <= 0x7FF) {
+			out[0] = 0xC0 | (co>>6);
+			out[1] = 0x80 | (co & 0x3F);
+			return 2;
+		}
+		if (co <= 0xFFFF) {
+			out[0] = 0xE0 | (co>>12);
+			out[1] = 0x80 | ((co>>6) & 0x3F);
+			out[2] = 0x80 | (co & 0x3F);
+			return 3;
+		}
+		if (co <= 0x10FFFF) {
+			out[0] = 0xF0 | (co>>18);
+			out[1] = 0x80 | ((co>>12) & 0x3F);
+			out[2] = 0x80 | ((co>>6) & 0x3F);
+			out[3] = 0x80 | (co & 0x3F);
+			return 4;
+		}
+		out[0] = '?';
+		return 1;
+	}
 };
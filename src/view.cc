@@ -1,5 +1,6 @@
 #include "common.h"
 #include "view.h"
+#include "search.h"
 #include "syntax.h"
 #include "syntax/cpp.h"
 #include "syntax/ini.h"
@@ -33,10 +34,12 @@ extern Config config;
 using namespace std::literals::chrono_literals;
 
 View::View() {
+	compactor.start(1);
 	sanity();
 	tabs.hard = config.tabs.hard;
 	tabs.width = config.tabs.width;
-	syntax = new PlainText();
+	syntax = std::make_shared<PlainText>();
+	forget();
 }
 
 View::View(const View& other) : View() {
@@ -48,22 +51,23 @@ View& View::operator=(const View& other) {
 	text = other.text;
 	selections = other.selections;
 	modified = other.modified;
-	undos.clear();
-	redos.clear();
 	autosyntax();
 	sanity();
+	forget();
 	return *this;
 }
 
 View::~View() {
-	delete syntax;
-	syntax = nullptr;
+	release();
 }
 
 void View::sanity() {
+	// runs once at commit
+	if (transaction) return;
+
 	if (!text.size()) text = {'\n'};
 
-	top = std::max(0, std::min(top, (int)text.lines.size()-1));
+	top = std::max(0, std::min(top, (int)text.line_count()-1));
 
 	// bounds
 	for (auto& selection: selections) {
@@ -71,46 +75,63 @@ void View::sanity() {
 		selection.length = std::max(0, std::min((int)text.size() - selection.offset, selection.length));
 	}
 
-	// duplicates, overlaps
-	std::vector<ViewRegion> keep;
-
-	auto within = [&](int offset, int length, int p) {
-		return p >= offset && p < offset+length;
+	// Selections are kept sorted by offset and apart. Once sorted, each can
+	// only clash with the one kept before it: starting at the same offset or
+	// inside it drops the later one.
+	auto before = [](auto& a, auto& b) {
+		return a.offset < b.offset;
 	};
+	if (!std::is_sorted(selections.begin(), selections.end(), before)) {
+		std::stable_sort(selections.begin(), selections.end(), before);
+	}
 
-	for (auto candidate: selections) {
-		bool clash = false;
-		for (auto& selection: keep) {
-			bool same = candidate.offset == selection.offset && candidate.length == selection.length;
-			bool overlapA = within(selection.offset, selection.length, candidate.offset);
-			bool overlapB = within(selection.offset, selection.length, candidate.offset+std::max(0,candidate.length-1));
-			bool overlapC = within(candidate.offset, candidate.length, selection.offset);
-			bool overlapD = within(candidate.offset, candidate.length, selection.offset+std::max(0,selection.length-1));
-			clash = (same || overlapA || overlapB || overlapC || overlapD);
-			if (clash) break;
+	int keep = 0;
+	for (auto& candidate: selections) {
+		if (keep) {
+			auto& last = selections[keep-1];
+			if (candidate.offset == last.offset || candidate.offset < last.offset+last.length) continue;
 		}
-		if (!clash) keep.push_back(candidate);
+		selections[keep++] = candidate;
 	}
-
-	selections = keep;
+	selections.resize(keep);
 
 	if (!selections.size()) {
 		selections.push_back({0,0});
 	}
 
 	intoView(selections.back());
+	track();
+	if (words.base) words.update(text);
 }
 
+// Line and column queries descend Doc's line index rather than stepping
+// through characters. Offsets past either end of the text count as part
+// of the first or last line.
+
 int View::toSol(int offset) {
-	int start = offset;
-	while (start > 0 && !sol(start)) start--;
-	return offset-start;
+	if (offset <= 0 || !text.size()) return 0;
+	int end = std::min(offset, (int)text.size());
+	return text.cursor(end).cell + offset-end;
 }
 
 int View::toEol(int offset) {
-	int end = offset;
-	while (end < (int)text.size() && !eol(end)) end++;
-	return end-offset;
+	if (offset >= (int)text.size()) return 0;
+	int start = std::max(offset, 0);
+	return lineEnd(text.cursor(start).line) - offset;
+}
+
+// offset of the newline ending a line, or the end of the text
+int View::lineEnd(int line) {
+	if (line+1 >= (int)text.line_count()) return text.size();
+	return text.line_offset(line+1)-1;
+}
+
+// offset of a column on a line, or the line's end when it is shorter
+int View::lineAt(int line, int column) {
+	if (!text.size()) return 0;
+	line = std::max(0, std::min(line, (int)text.line_count()-1));
+	int start = text.line_offset(line);
+	return start + std::min(column, lineEnd(line)-start);
 }
 
 int View::get(int offset) {
@@ -129,155 +150,529 @@ std::string View::extract(ViewRegion region) {
 	return text.extract(region.offset, region.length);
 }
 
+// The undo journal is a header then a run of records:
+//
+//   'c' type selections edits  push a change onto undos
+//   'u' selections             move the newest undo to redos
+//   'r' selections             move the newest redo to undos
+//   'd' stack count            drop the oldest changes from undos or redos
+//   's' hash                   the file was saved with this content hash
+//
+// Numbers are LEB128, strings are length prefixed and an edit is its
+// offset, removed, inserted, before and after.
+static const std::string journalMagic = "sce-undo 1\n";
+
+static void putJournal(std::string& out, uint64_t n) {
+	do {
+		out += (char)((n & 0x7f) | (n > 0x7f ? 0x80: 0));
+		n >>= 7;
+	} while (n);
+}
+
+static void putJournal(std::string& out, const std::string& str) {
+	putJournal(out, str.size());
+	out += str;
+}
+
+static void putJournal(std::string& out, const std::vector<ViewRegion>& regions) {
+	putJournal(out, regions.size());
+	for (auto& region: regions) {
+		putJournal(out, (uint32_t)region.offset);
+		putJournal(out, (uint32_t)region.length);
+	}
+}
+
+static void putJournal(std::string& out, const View::Change& change) {
+	out += 'c';
+	putJournal(out, change.type);
+	putJournal(out, change.selections);
+	putJournal(out, change.edits.size());
+	for (auto& edit: change.edits) {
+		putJournal(out, (uint32_t)edit.offset);
+		putJournal(out, (uint32_t)edit.removed);
+		putJournal(out, (uint32_t)edit.inserted);
+		putJournal(out, edit.before);
+		putJournal(out, edit.after);
+	}
+}
+
+// Decodes records in place from the mapped journal. A torn or corrupt
+// tail just ends the run.
+struct JournalReader {
+	const char* at = nullptr;
+	const char* end = nullptr;
+	bool ok = true;
+
+	uint64_t num() {
+		uint64_t n = 0;
+		for (int shift = 0; ok; shift += 7) {
+			if (at == end || shift > 63) { ok = false; break; }
+			uint8_t byte = *at++;
+			n |= (uint64_t)(byte & 0x7f) << shift;
+			if (!(byte & 0x80)) break;
+		}
+		return n;
+	}
+
+	std::string_view str() {
+		uint64_t n = num();
+		if (!ok || n > (uint64_t)(end-at)) { ok = false; return {}; }
+		std::string_view s(at, n);
+		at += n;
+		return s;
+	}
+
+	std::vector<ViewRegion> regions() {
+		std::vector<ViewRegion> out(std::min(num(), (uint64_t)(end-at)));
+		for (auto& region: out) {
+			region.offset = (int)num();
+			region.length = (int)num();
+		}
+		return out;
+	}
+};
+
+struct JournalRecord {
+	char kind = 0;
+	uint64_t value = 0;
+	uint64_t count = 0;
+	View::ChangeType type = View::SnapShot;
+	std::vector<ViewRegion> selections;
+	struct Edit {
+		int offset = 0;
+		int removed = 0;
+		int inserted = 0;
+		std::string_view before;
+		std::string_view after;
+	};
+	std::vector<Edit> edits;
+
+	bool read(JournalReader& in) {
+		if (in.at == in.end) return false;
+		kind = *in.at++;
+		switch (kind) {
+			case 'c':
+				type = (View::ChangeType)in.num();
+				selections = in.regions();
+				edits.resize(std::min(in.num(), (uint64_t)(in.end-in.at)));
+				for (auto& edit: edits) {
+					edit.offset = (int)in.num();
+					edit.removed = (int)in.num();
+					edit.inserted = (int)in.num();
+					edit.before = in.str();
+					edit.after = in.str();
+				}
+				break;
+			case 'u':
+			case 'r':
+				selections = in.regions();
+				break;
+			case 'd':
+				value = in.num();
+				count = in.num();
+				break;
+			case 's':
+				value = in.num();
+				break;
+			default:
+				in.ok = false;
+		}
+		return in.ok;
+	}
+};
+
+// journal records appended to path, or the whole file replaced
+static bool writeJournal(const std::string& path, const std::string& records, bool rewrite) {
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+	auto dest = rewrite ? path + ".tmp": path;
+	bool fresh = rewrite || std::filesystem::file_size(dest, ec) == 0 || ec;
+	auto out = std::ofstream(dest, std::ios::binary | (rewrite ? std::ios::trunc: std::ios::app));
+	if (fresh) out << journalMagic;
+	out << records;
+	out.close();
+	if (!out) return false;
+	if (rewrite) std::filesystem::rename(dest, path, ec);
+	return !ec;
+}
+
+// journal file for the current path, empty when journaling is off
+std::string View::journalPath() {
+	if (!config.view.journal.size() || !path.size() || text.size() >= config.view.large) return "";
+	uint64_t h = 0xcbf29ce484222325ull;
+	for (char c: path) h = (h ^ (uint8_t)c) * 0x100000001b3ull;
+	return fmt("%s/%016llx", config.view.journal, (unsigned long long)h);
+}
+
+// Rebuild the history from the journal up to its last save of the current
+// text. Records after that were never saved and are dropped.
+void View::restore() {
+	auto file = journalPath();
+	if (!file.size()) return;
+
+	Doc::Mapping map(file);
+	if (map.size < journalMagic.size() || std::string_view(map.data, journalMagic.size()) != journalMagic) return;
+
+	JournalReader in = {map.data+journalMagic.size(), map.data+map.size};
+	std::vector<JournalRecord> records;
+	JournalRecord record;
+	while (record.read(in)) records.push_back(std::move(record));
+
+	uint64_t hash = text.hash();
+	size_t saved = records.size();
+	for (size_t i = 0; i < records.size(); i++) {
+		if (records[i].kind == 's' && records[i].value == hash) saved = i;
+	}
+	if (saved == records.size()) return;
+
+	for (size_t i = 0; i < saved; i++) {
+		auto& record = records[i];
+		if (record.kind == 'c') {
+			Change change;
+			change.type = record.type;
+			change.selections = std::move(record.selections);
+			for (auto& e: record.edits) {
+				change.edits.push_back({e.offset, e.removed, e.inserted, std::string(e.before), std::string(e.after)});
+			}
+			history += bytes(change);
+			undos.push_back(std::move(change));
+		}
+		if (record.kind == 'u' || record.kind == 'r') {
+			auto& from = record.kind == 'u' ? undos: redos;
+			auto& to = record.kind == 'u' ? redos: undos;
+			// the journal lost records somewhere
+			if (!from.size()) break;
+			history -= bytes(from.back());
+			from.back().selections = std::move(record.selections);
+			history += bytes(from.back());
+			to.push_back(std::move(from.back()));
+			from.pop_back();
+		}
+		if (record.kind == 'd') {
+			auto& changes = record.value ? redos: undos;
+			discard(changes, std::min(record.count, (uint64_t)changes.size()));
+		}
+	}
+
+	// replaying logged the drops again
+	journal.clear();
+	compact(config.view.undo);
+
+	// keep appending unless unsaved records trail or dropped history dominates
+	rewrite = saved+1 < records.size() || map.size > 2*history+(1<<20);
+}
+
+// start the undo history afresh from the current text
+void View::forget() {
+	discard(undos, undos.size());
+	discard(redos, redos.size());
+	pending = false;
+	regions.clear();
+	base = text.snapshot();
+	tracked = text.version;
+	trimmed = text.version;
+	journal.clear();
+	rewrite = true;
+}
+
+// memory held by a change, near enough
+size_t View::bytes(const Change& change) {
+	size_t n = sizeof(Change) + change.selections.capacity()*sizeof(ViewRegion) + change.edits.capacity()*sizeof(Edit);
+	for (auto& edit: change.edits) n += edit.before.size() + edit.after.size();
+	return n;
+}
+
+// remove the oldest count changes from a stack, to be freed on a worker
+void View::discard(std::vector<Change>& changes, size_t count) {
+	if (!count) return;
+	for (size_t i = 0; i < count; i++) {
+		size_t n = bytes(changes[i]);
+		history -= n;
+		droppedBytes += n;
+		dropped.push_back(std::move(changes[i]));
+	}
+	changes.erase(changes.begin(), changes.begin()+count);
+	journal += 'd';
+	putJournal(journal, &changes == &redos);
+	putJournal(journal, count);
+	if (droppedBytes >= 1<<20) release();
+}
+
+// hand the dropped changes to the compactor in one job
+void View::release() {
+	if (dropped.empty()) return;
+	auto gone = std::make_shared<std::vector<Change>>(std::move(dropped));
+	compactor.job([gone=std::move(gone)]() mutable {
+		gone.reset();
+	});
+	dropped.clear();
+	droppedBytes = 0;
+}
+
+// Drop the oldest undos and then the furthest redos until the history
+// fits in limit bytes. The newest undo always stays.
+void View::compact(size_t limit) {
+	size_t over = history > limit ? history-limit: 0;
+
+	auto count = [&](std::vector<Change>& changes, size_t keep) {
+		size_t n = 0;
+		for (; over && n+keep < changes.size(); n++) {
+			over -= std::min(over, bytes(changes[n]));
+		}
+		return n;
+	};
+
+	discard(undos, count(undos, 1));
+	discard(redos, count(redos, 0));
+}
+
+// Fold edits made since the last call into the open change, opening one
+// for edits made outside any
+void View::track() {
+	if (text.version == tracked) return;
+
+	if (!pending) {
+		Change change;
+		change.type = SnapShot;
+		change.selections = selections;
+		history += bytes(change);
+		undos.push_back(change);
+		discard(redos, redos.size());
+		pending = true;
+	}
+
+	if (text.recent(tracked)) {
+		for (auto& change: text.changes(tracked)) Doc::fold(regions, change);
+	}
+	else {
+		regions = {{0, text.size(), base->size()}};
+	}
+	tracked = text.version;
+}
+
+// keep only the text the open change replaced and what replaced it
+void View::close() {
+	track();
+	if (!pending) return;
+
+	auto& change = undos.back();
+	history -= bytes(change);
+	int shift = 0;
+	for (auto& region: regions) {
+		Edit edit;
+		edit.offset = (int)region.offset-shift;
+		edit.removed = region.removed;
+		edit.inserted = region.length;
+		edit.before = base->extract(edit.offset, edit.removed);
+		edit.after = text.extract(region.offset, region.length);
+		change.edits.push_back(std::move(edit));
+		shift += (int)region.length-(int)region.removed;
+	}
+	history += bytes(change);
+	putJournal(journal, change);
+
+	pending = false;
+	regions.clear();
+	base = text.snapshot();
+	compact(config.view.undo);
+}
+
 void View::nav() {
+	close();
 	Change change;
 	change.type = Navigation;
 	change.selections = selections;
+	history += bytes(change);
+	putJournal(journal, change);
 	undos.push_back(change);
-	redos.clear();
+	discard(redos, redos.size());
+	compact(config.view.undo);
 }
 
 void View::snap() {
-	redos.clear();
+	// a transaction is one undo step
+	if (transaction) {
+		if (snapped) return;
+		snapped = true;
+	}
+	close();
+	discard(redos, redos.size());
 	Change change;
 	change.type = SnapShot;
 	change.selections = selections;
-	change.text = deflate(text.exportRaw(), defl);
+	history += bytes(change);
 	undos.push_back(change);
+	pending = true;
+}
+
+// Edits between begin() and commit() take at most one snapshot and one
+// sanity pass, however many steps they are made of. Nests.
+void View::begin() {
+	if (!transaction++) snapped = false;
+}
+
+void View::commit() {
+	if (--transaction) return;
+	sanity();
 }
 
 bool View::insertion() {
-	return undos.size() && undos.back().type == SnapShot && undos.back().text.size/sizeof(int) < text.size();
+	return pending && base->size() < text.size();
 }
 
 bool View::deletion() {
-	return undos.size() && undos.back().type == SnapShot && undos.back().text.size/sizeof(int) > text.size();
+	return pending && base->size() > text.size();
 }
 
 void View::undo() {
+	close();
 	if (!undos.size()) return;
-	modified = true;
 
-	auto& undo = undos.back();
+	auto undo = std::move(undos.back());
+	undos.pop_back();
+	history -= bytes(undo);
 
-	if (undo.type == SnapShot) {
-		Change redo;
-		redo.type = SnapShot;
-		redo.selections = selections;
-		redo.text = deflate(text.exportRaw(), defl);
-		redos.push_back(redo);
-		text.importRaw(inflate(undo.text));
-		selections = undo.selections;
+	// earlier edits are already reverted, so each is at its own offset
+	for (auto& edit: undo.edits) {
+		text.erase(text.begin()+edit.offset, edit.inserted);
+		text.insert(text.begin()+edit.offset, edit.before);
 	}
 
-	if (undo.type == Navigation) {
-		Change redo;
-		redo.type = Navigation;
-		redo.selections = selections;
-		redos.push_back(redo);
-		selections = undo.selections;
-	}
+	std::swap(selections, undo.selections);
+	history += bytes(undo);
+	journal += 'u';
+	putJournal(journal, undo.selections);
+	redos.push_back(std::move(undo));
 
-	undos.pop_back();
-	if (!undos.size()) modified = !(inflate(orig) == text.exportRaw());
+	base = text.snapshot();
+	tracked = text.version;
+	modified = !orig || *orig != text.hash();
 
 	sanity();
 }
 
 void View::redo() {
+	close();
 	if (!redos.size()) return;
-	modified = true;
 
-	auto& redo = redos.back();
+	auto redo = std::move(redos.back());
+	redos.pop_back();
+	history -= bytes(redo);
 
-	if (redo.type == SnapShot) {
-		Change undo;
-		undo.type = SnapShot;
-		undo.selections = selections;
-		undo.text = deflate(text.exportRaw(), defl);
-		undos.push_back(undo);
-		text.importRaw(inflate(redo.text));
-		selections = redo.selections;
+	int shift = 0;
+	for (auto& edit: redo.edits) {
+		int offset = edit.offset+shift;
+		text.erase(text.begin()+offset, edit.removed);
+		text.insert(text.begin()+offset, edit.after);
+		shift += edit.inserted-edit.removed;
 	}
 
-	if (redo.type == Navigation) {
-		Change undo;
-		undo.type = Navigation;
-		undo.selections = selections;
-		undos.push_back(undo);
-		selections = redo.selections;
-	}
+	std::swap(selections, redo.selections);
+	history += bytes(redo);
+	journal += 'r';
+	putJournal(journal, redo.selections);
+	undos.push_back(std::move(redo));
+
+	base = text.snapshot();
+	tracked = text.version;
+	modified = !orig || *orig != text.hash();
 
-	redos.pop_back();
 	sanity();
 }
 
 bool View::erase() {
-	snap();
-	bool erased = false;
+	auto erasable = [&](const ViewRegion& selection) {
+		return selection.offset < (int)text.size()
+			&& selection.length > 0
+			&& selection.offset+selection.length <= (int)text.size();
+	};
 
-	for (int i = 0; i < (int)selections.size(); i++) {
-		auto& selection = selections[i];
+	if (std::none_of(selections.begin(), selections.end(), erasable)) return false;
 
-		if (selection.offset < (int)text.size()
-			&& selection.length > 0
-			&& selection.offset+selection.length <= (int)text.size()
-		){
-			erased = true;
-			auto it = text.begin()+selection.offset;
-
-			text.erase(it, it+selection.length);
-			for (int j = 0; j < (int)selections.size(); j++) {
-				auto& jselection = selections[j];
-				if (jselection.offset > selection.offset) {
-					jselection.offset -= selection.length;
-				}
-			}
+	snap();
+
+	std::vector<Splice> splices;
+	for (auto& selection: selections) {
+		if (erasable(selection)) {
+			splices.push_back({selection.offset, selection.length, ""});
 			selection.length = 0;
 		}
 	}
-	if (!erased) {
-		undos.pop_back();
+	splice(std::move(splices));
+	sanity();
+	modified = true;
+	return true;
+}
+
+// Replace the splices, sorted and apart, from right to left so each lands
+// at its own offset. Then every selection moves by the running total of
+// the changes before it, found by binary search, and one inside a replaced
+// range moves to its start.
+void View::splice(std::vector<Splice> splices) {
+	std::stable_sort(splices.begin(), splices.end(), [](auto& a, auto& b) {
+		return a.offset < b.offset;
+	});
+
+	std::vector<int> shift(splices.size());
+	for (int i = (int)splices.size()-1; i >= 0; i--) {
+		auto& splice = splices[i];
+		int before = text.size();
+		if (splice.length) text.erase(text.begin()+splice.offset, splice.length);
+		// single characters go through the path that extends the last piece
+		if (splice.text.size() && splice.text.size() == (size_t)UTF8::width(splice.text[0])) {
+			text.insert(text.begin()+splice.offset, UTF8::decode(splice.text.data()));
+		}
+		else
+		if (splice.text.size()) {
+			text.insert(text.begin()+splice.offset, splice.text);
+		}
+		shift[i] = (int)text.size()-before;
 	}
-	if (erased) {
-		sanity();
-		modified = true;
+	for (int i = 1; i < (int)shift.size(); i++) shift[i] += shift[i-1];
+
+	for (auto& selection: selections) {
+		int p = selection.offset;
+		auto it = std::upper_bound(splices.begin(), splices.end(), p, [](int p, auto& splice) {
+			return p < splice.offset+splice.length;
+		});
+		int i = it-splices.begin();
+		int before = i ? shift[i-1]: 0;
+		selection.offset = it != splices.end() && it->offset < p ? it->offset+before: p+before;
 	}
-	return erased;
 }
 
-void View::insertAt(ViewRegion selection, int c, bool autoindent) {
-	auto it = text.begin()+selection.offset;
-
-	int inserted = 1;
-	it = text.insert(it, c)+1;
+// c typed at offset, with a new line copying the indent before it
+std::string View::typed(int offset, int c, bool autoindent) {
+	char bytes[4];
+	std::string s(bytes, UTF8::encode(c, bytes));
 
 	if (autoindent && c == '\n') {
-		int left = toSol(selection.offset);
-		int start = selection.offset-left;
-
-		std::vector<uint32_t> indent;
-		while (iswspace(text[start]) && text[start] != '\n') {
-			indent.push_back(text[start++]);
+		int start = offset-toSol(offset);
+		for (auto in = text.read(start); (int)in.offset < offset; ) {
+			auto w = in.next();
+			if (!iswspace(w) || w == '\n') break;
+			s.append(bytes, UTF8::encode(w, bytes));
 		}
-
-		text.insert(it, indent.begin(), indent.end());
-		inserted += indent.size();
 	}
+	return s;
+}
 
-	for (int j = 0; j < (int)selections.size(); j++) {
-		auto& jselection = selections[j];
-		if (jselection.offset >= selection.offset) {
-			jselection.offset += inserted;
-		}
-	}
+void View::insertAt(ViewRegion selection, int c, bool autoindent) {
+	splice({{selection.offset, 0, typed(selection.offset, c, autoindent)}});
+}
+
+void View::insertAt(ViewRegion selection, const std::string& s) {
+	splice({{selection.offset, 0, s}});
 }
 
 void View::insert(int c, bool autoindent) {
 	if ((!erase() && !insertion()) || c == '\n') snap();
+
+	std::vector<Splice> splices;
 	for (auto& selection: selections) {
-		insertAt(selection, c, autoindent);
+		splices.push_back({selection.offset, 0, typed(selection.offset, c, autoindent)});
 	}
+	splice(std::move(splices));
 	modified = true;
 	sanity();
 }
@@ -328,46 +723,32 @@ void View::back(int c) {
 
 	if (!erase()) {
 		if (!deletion()) snap();
-		for (int i = 0; i < (int)selections.size(); i++) {
-			auto selection = selections[i];
+		std::vector<Splice> splices;
+		for (auto& selection: selections) {
 			if (!selection.offset) continue;
-			auto it = text.begin()+selection.offset;
 			if (c && c != get(selection.offset-1)) continue;
-
-			text.erase(it-1, it);
-			for (int j = 0; j < (int)selections.size(); j++) {
-				auto& jselection = selections[j];
-				if (jselection.offset >= selection.offset) {
-					jselection.offset -= 1;
-				}
-			}
+			splices.push_back({selection.offset-1, 1, ""});
 		}
+		splice(std::move(splices));
 		modified = true;
 		sanity();
 	}
 }
 
 void View::delAt(ViewRegion selection) {
-	auto it = text.begin()+selection.offset;
-
-	text.erase(it, it+1);
-	for (int j = 0; j < (int)selections.size(); j++) {
-		auto& jselection = selections[j];
-		if (jselection.offset > selection.offset) {
-			jselection.offset -= 1;
-		}
-	}
+	splice({{selection.offset, 1, ""}});
 }
 
 void View::del(int c) {
 	if (!erase()) {
 		if (!deletion()) snap();
-		for (int i = 0; i < (int)selections.size(); i++) {
-			auto& selection = selections[i];
+		std::vector<Splice> splices;
+		for (auto& selection: selections) {
 			if (c && c != get(selection.offset)) continue;
-			if (selection.offset == text.size()) continue;
-			delAt(selection);
+			if (selection.offset == (int)text.size()) continue;
+			splices.push_back({selection.offset, 1, ""});
 		}
+		splice(std::move(splices));
 		modified = true;
 		sanity();
 	}
@@ -389,10 +770,9 @@ void View::clip() {
 
 	std::string cliptext;
 	for (auto& selection: selections) {
-		auto it = text.begin()+selection.offset;
 		Clip clip;
-		clip.text = {it, it+selection.length};
-		cliptext = text.extract(it, it+selection.length);
+		clip.text = text.extract((size_t)selection.offset, (size_t)selection.length);
+		cliptext = clip.text;
 		clip.line = lines.front();
 		lines.pop_front();
 		clips.push_back(clip);
@@ -413,41 +793,35 @@ void View::copy() {
 }
 
 void View::paste() {
+	begin();
 	if (!erase()) snap();
 	int nclips = clips.size();
 
-	UTF8 clipboard(ImGui::GetClipboardText());
+	std::string clipboard = ImGui::GetClipboardText();
 
-	for (int i = selections.size()-1; i >= 0; --i) {
+	// whole lines go in above the cursor's line, which then stays put
+	std::vector<Splice> splices;
+	for (int i = 0; i < (int)selections.size(); i++) {
 		auto& selection = selections[i];
 		// when single clip/selection, clipboard takes precedence
-		auto clipText = nclips > 1 && nclips > i ? clips[i].text: clipboard.codes;
+		auto& clipText = nclips > 1 && nclips > i ? clips[i].text: clipboard;
 		auto clipLine = nclips > 1 && nclips > i ? clips[i].line: false;
 		int offset = selection.offset;
-
-		if (clipLine) {
-			int left = toSol(selection.offset);
-			selection.offset -= left;
-		}
-
-		for (auto c: clipText) {
-			insertAt(selection, c, false);
-		}
-
-		if (clipLine) {
-			selection.offset = offset;
-			downAt(selection);
-		}
+		if (clipLine) offset -= toSol(offset);
+		splices.push_back({offset, 0, clipText});
 	}
+	splice(std::move(splices));
 	modified = true;
-	sanity();
+	commit();
 }
 
 bool View::dup() {
+	begin();
 	copy();
 	for (auto& selection: selections)
 		selection.length = 0;
 	paste();
+	commit();
 	return true;
 }
 
@@ -459,26 +833,24 @@ int View::lower(int c) {
 	return tolower(c);
 }
 
+// move a cursor by lines, keeping its column where the line is long enough
+void View::lines(ViewRegion& selection, int n) {
+	auto cursor = text.cursor(std::max(0, std::min(selection.offset, (int)text.size())));
+	int line = (int)cursor.line+n;
+	// past the last line is the end of the text
+	selection.offset = line >= (int)text.line_count() ? (int)text.size(): lineAt(line, cursor.cell);
+	selection.length = 0;
+}
+
 void View::up() {
 	for (auto& selection: selections) {
-		int left = toSol(selection.offset);
-		selection.offset -= left;
-		selection.offset--;
-		selection.offset -= toSol(selection.offset);
-		int right = toEol(selection.offset);
-		selection.offset += std::min(left, right);
-		selection.length = 0;
+		lines(selection, -1);
 	}
 	sanity();
 }
 
 void View::downAt(ViewRegion& selection) {
-	int left = toSol(selection.offset);
-	selection.offset += toEol(selection.offset);
-	selection.offset++;
-	int right = toEol(selection.offset);
-	selection.offset += std::min(left, right);
-	selection.length = 0;
+	lines(selection, 1);
 }
 
 void View::down() {
@@ -508,7 +880,7 @@ void View::left() {
 void View::home() {
 	shrink();
 	for (auto& selection: selections) {
-		while (!sol(selection.offset)) selection.offset--;
+		selection.offset -= toSol(selection.offset);
 	}
 	sanity();
 }
@@ -516,20 +888,20 @@ void View::home() {
 void View::end() {
 	shrink();
 	for (auto& selection: selections) {
-		while (!eol(selection.offset)) selection.offset++;
+		selection.offset += toEol(selection.offset);
 	}
 	sanity();
 }
 
 void View::pgup() {
 	single();
-	for (int i = 0; h > 0 && i < h; i++) up();
+	if (h > 0) lines(selections.front(), -h);
 	sanity();
 }
 
 void View::pgdown() {
 	single();
-	for (int i = 0; h > 0 && i < h; i++) down();
+	if (h > 0) lines(selections.front(), h);
 	sanity();
 }
 
@@ -539,7 +911,7 @@ void View::bumpup() {
 }
 
 void View::bumpdown() {
-	top = std::min((int)text.lines.size()-1, top+1);
+	top = std::min((int)text.line_count()-1, top+1);
 	sanity();
 }
 
@@ -598,50 +970,77 @@ void View::selectUp() {
 	sanity();
 }
 
+// Select the next occurrence of the selected text after the latest match,
+// wrapping around to the start
 bool View::selectNext() {
-	bool match = false;
-	auto& pattern = selections.front();
-	auto& marker = selections.back();
+	auto pattern = selections.front();
 	if (!pattern.length) return false;
 
+	auto at = [&](int offset) {
+		return std::lower_bound(selections.begin(), selections.end(), offset, [](auto& s, int offset) {
+			return s.offset < offset;
+		});
+	};
+
 	auto duplicate = [&](int i) {
-		for (auto& other: selections)
-			if (other.offset == i) return true;
-		return false;
+		auto it = at(i);
+		return it != selections.end() && it->offset == i;
 	};
 
-	auto cmp = text.subdoc(pattern.offset, pattern.length);
+	auto marker = duplicate(latest.offset) ? latest: selections.back();
 
-	auto check = [&](int i) {
-		auto a = cmp.begin();
-		auto b = text.begin()+i;
-		bool match = true;
-		for (int j = 0; j < pattern.length && match; j++) {
-			match = match && (*a == *b);
-			++a; ++b;
-		}
-		if (match) {
-			nav();
-			if (marker.offset == skip.offset && marker.length == skip.length)
-				selections.pop_back();
-			selections.push_back({i,pattern.length});
-			skip = {-1,-1};
-		}
-		return match;
+	// the first match after the marker not already selected, wrapping
+	auto& hits = occurrences(extract(pattern));
+	auto fresh = [&](auto it, auto end) {
+		while (it != end && duplicate(it->offset)) ++it;
+		return it != end ? std::optional<ViewRegion>(*it): std::nullopt;
 	};
-
-	for (int i = marker.offset+1; i < (int)text.size()-pattern.length && !match; i++) {
-		if (!duplicate(i)) match = check(i);
-	}
-	for (int i = 0; i < pattern.offset && i < (int)text.size()-pattern.length && !match; i++) {
-		if (!duplicate(i)) match = check(i);
+	auto after = std::upper_bound(hits.begin(), hits.end(), marker.offset, [](int offset, auto& hit) {
+		return offset < hit.offset;
+	});
+	auto found = fresh(after, hits.end());
+	if (!found) found = fresh(hits.begin(), std::lower_bound(hits.begin(), after, marker.offset, [](auto& hit, int offset) {
+		return hit.offset < offset;
+	}));
+
+	if (found) {
+		nav();
+		if (marker == skip) selections.erase(at(marker.offset));
+		latest = *found;
+		selections.insert(at(latest.offset), latest);
+		skip = {-1,-1};
 	}
 	sanity();
+	if (found) intoView(latest);
+	return true;
+}
+
+// every match of the first selection, installed at once
+bool View::selectOccurrences() {
+	auto pattern = selections.front();
+	if (!pattern.length) return false;
+	nav();
+	selections = occurrences(extract(pattern));
+	latest = {-1,-1};
+	skip = {-1,-1};
+	sanity();
 	return true;
 }
 
+// all matches of needle, kept until the text changes
+const std::vector<ViewRegion>& View::occurrences(const std::string& needle) {
+	if (matches.needle != needle || matches.version != text.version || matches.hash != text.hash()) {
+		matches.needle = needle;
+		matches.version = text.version;
+		matches.hash = text.hash();
+		matches.regions = search(needle);
+	}
+	return matches.regions;
+}
+
 void View::selectSkip() {
-	skip = selections.back();
+	auto it = std::find(selections.begin(), selections.end(), latest);
+	skip = it != selections.end() ? latest: selections.back();
 }
 
 void View::selectAll() {
@@ -661,7 +1060,7 @@ void View::intoView(ViewRegion selection) {
 		top--;
 	}
 
-	top = std::max(0, std::min((int)text.lines.size()-1, top));
+	top = std::max(0, std::min((int)text.line_count()-1, top));
 }
 
 void View::boundaryRight() {
@@ -689,11 +1088,10 @@ void View::single() {
 		if (clips.size() > 1) {
 			Clip clip;
 			for (auto c: clips) {
-				clip.text.insert(clip.text.end(), c.text.begin(), c.text.end());
+				clip.text += c.text;
 				clip.text.push_back('\n');
 			}
-			auto cliptext = std::string({clip.text.begin(), clip.text.end()});
-			ImGui::SetClipboardText(cliptext.c_str());
+			ImGui::SetClipboardText(clip.text.c_str());
 			clips.clear();
 			clips = {clip};
 		}
@@ -715,14 +1113,7 @@ void View::shrink() {
 void View::addCursorDown() {
 	nav();
 	selections.push_back(selections.back());
-
-	auto& selection = selections.back();
-	int left = toSol(selection.offset);
-	selection.offset += toEol(selection.offset);
-	selection.offset++;
-	int right = toEol(selection.offset);
-	selection.offset += std::min(left, right);
-	selection.length = 0;
+	lines(selections.back(), 1);
 
 	sanity();
 }
@@ -730,15 +1121,7 @@ void View::addCursorDown() {
 void View::addCursorUp() {
 	nav();
 	selections.insert(selections.begin(), selections.front());
-
-	auto& selection = selections.front();
-	int left = toSol(selection.offset);
-	selection.offset -= left;
-	selection.offset--;
-	selection.offset -= toSol(selection.offset);
-	int right = toEol(selection.offset);
-	selection.offset += std::min(left, right);
-	selection.length = 0;
+	lines(selections.front(), -1);
 
 	sanity();
 }
@@ -748,17 +1131,16 @@ bool View::interpret(const std::string& cmd) {
 		return cmd.find(s) == 0;
 	};
 
-	auto find = [&](int from, const std::string& needle, std::function<bool(const std::string& needle, int offset)> match) {
-		selections.clear();
-
-		for (int i = from; !selections.size() && i < (int)text.size(); i++) {
-			if (match(needle, i)) selections.push_back({i,(int)needle.size()});
-		}
+	// a preview only moves and searches
+	if (!indexed() && (prefix("tabs ") || cmd == "trim" || cmd == "lower" || cmd == "upper")) return false;
 
-		for (int i = 0; !selections.size() && i < from; i++) {
-			if (match(needle, i)) selections.push_back({i,(int)needle.size()});
+	// select the first match at or after the last selection, wrapping
+	auto find = [&](const Search& search) {
+		int from = selections.back().offset;
+		selections.clear();
+		if (auto match = search.next(text, from)) {
+			selections.push_back({(int)match->offset, (int)match->length});
 		}
-
 		sanity();
 	};
 
@@ -773,39 +1155,33 @@ bool View::interpret(const std::string& cmd) {
 	}
 
 	if (prefix("find ") && cmd.size() > 5U) {
-		int from = selections.back().offset;
 		auto needle = cmd.substr(5); trim(needle);
-
-		auto match = [&](const std::string& needle, int offset) {
-			for (int i = 0; i < (int)needle.size(); i++) {
-				if (get(offset+i) != needle[i]) return false;
-			}
-			return true;
-		};
-
-		find(from, needle, match);
+		find(Search(needle));
 		return true;
 	}
 
 	if (prefix("ifind ") && cmd.size() > 6U) {
-		int from = selections.back().offset;
 		auto needle = cmd.substr(6); trim(needle);
+		find(Search(needle, true));
+		return true;
+	}
 
-		auto match = [&](const std::string& needle, int offset) {
-			for (int i = 0; i < (int)needle.size(); i++) {
-				if (std::toupper(get(offset+i)) != std::toupper(needle[i])) return false;
-			}
-			return true;
-		};
+	if (prefix("wfind ") && cmd.size() > 6U) {
+		auto needle = cmd.substr(6); trim(needle);
+		find(Search(needle, false, true));
+		return true;
+	}
 
-		find(from, needle, match);
+	if (prefix("rfind ") && cmd.size() > 6U) {
+		auto needle = cmd.substr(6); trim(needle);
+		find(Search(needle, false, false, true));
 		return true;
 	}
 
 	if (prefix("go ")) {
 		int lineno = 0;
-		if (text.lines.size() && 1 == std::sscanf(cmd.c_str(), "go %d", &lineno)) {
-			lineno = std::max(1, std::min((int)text.lines.size(), lineno));
+		if (text.line_count() && 1 == std::sscanf(cmd.c_str(), "go %d", &lineno)) {
+			lineno = std::max(1, std::min((int)text.line_count(), lineno));
 			selections.clear();
 			selections.push_back({(int)text.line_offset(lineno-1), 0});
 		}
@@ -836,6 +1212,11 @@ bool View::interpret(const std::string& cmd) {
 		return true;
 	}
 
+	if (cmd == "occurrences") {
+		selectOccurrences();
+		return true;
+	}
+
 	if (cmd == "reload") {
 		reload();
 		return true;
@@ -845,86 +1226,72 @@ bool View::interpret(const std::string& cmd) {
 		auto name = cmd.substr(7);
 
 		if (name == "cpp") {
-			delete syntax;
-			syntax = new CPP();
+			syntax = std::make_shared<CPP>();
 			return true;
 		}
 
 		if (name == "ini") {
-			delete syntax;
-			syntax = new INI();
+			syntax = std::make_shared<INI>();
 			return true;
 		}
 
 		if (name == "yaml") {
-			delete syntax;
-			syntax = new YAML();
+			syntax = std::make_shared<YAML>();
 			return true;
 		}
 
 		if (name == "xml") {
-			delete syntax;
-			syntax = new XML();
+			syntax = std::make_shared<XML>();
 			return true;
 		}
 
 		if (name == "make") {
-			delete syntax;
-			syntax = new Make();
+			syntax = std::make_shared<Make>();
 			return true;
 		}
 
 		if (name == "cmake") {
-			delete syntax;
-			syntax = new CMake();
+			syntax = std::make_shared<CMake>();
 			return true;
 		}
 
 		if (name == "openscad") {
-			delete syntax;
-			syntax = new OpenSCAD();
+			syntax = std::make_shared<OpenSCAD>();
 			return true;
 		}
 
 		if (name == "js") {
-			delete syntax;
-			syntax = new JavaScript();
+			syntax = std::make_shared<JavaScript>();
 			return true;
 		}
 
 		if (name == "bash") {
-			delete syntax;
-			syntax = new Bash();
+			syntax = std::make_shared<Bash>();
 			return true;
 		}
 
 		if (name == "docker") {
-			delete syntax;
-			syntax = new Docker();
+			syntax = std::make_shared<Docker>();
 			return true;
 		}
 
 		if (name == "forth") {
-			delete syntax;
-			syntax = new Forth();
+			syntax = std::make_shared<Forth>();
 			return true;
 		}
 
 		if (name == "rela") {
-			delete syntax;
-			syntax = new Rela();
+			syntax = std::make_shared<Rela>();
 			return true;
 		}
 
 		if (name == "haxe") {
-			delete syntax;
-			syntax = new Haxe();
+			syntax = std::make_shared<Haxe>();
 			return true;
 		}
 
 		if (name == "plaintext") {
-			delete syntax;
-			syntax = new PlainText();
+			syntax = std::make_shared<PlainText>();
 			return true;
 		}
 	}
@@ -943,9 +1310,10 @@ bool View::interpret(const std::string& cmd) {
 }
 
 std::vector<std::string> View::autocomplete() {
+	words.update(text);
 	std::vector<std::string> matches;
 	for (auto& selection: selections) {
-		auto batch = syntax->matches(text, selection.offset);
+		auto batch = syntax->matches(text, words, selection.offset);
 		matches.insert(matches.end(), batch.begin(), batch.end());
 	}
 	std::sort(matches.begin(), matches.end());
@@ -954,6 +1322,9 @@ std::vector<std::string> View::autocomplete() {
 }
 
 void View::input() {
+	// a large file's preview can be browsed but not edited
+	bool edit = indexed();
+
 	ImGuiIO& io = ImGui::GetIO();
 
 	//bool Alt = !io.KeyCtrl && io.KeyAlt && !io.KeyShift && !io.KeySuper;
@@ -968,36 +1339,37 @@ void View::input() {
 
 	if (CtrlShift && ImGui::IsKeyPressed(KeyMap[KEY_RIGHT])) { selectRightBoundary(); return; }
 	if (CtrlShift && ImGui::IsKeyPressed(KeyMap[KEY_LEFT])) { selectLeftBoundary(); return; }
-	if (CtrlShift && ImGui::IsKeyPressed(KeyMap[KEY_D])) { dup(); return; }
+	if (edit && CtrlShift && ImGui::IsKeyPressed(KeyMap[KEY_D])) { dup(); return; }
+	if (CtrlShift && ImGui::IsKeyPressed(KeyMap[KEY_L])) { selectOccurrences(); return; }
 
 	if (Shift && ImGui::IsKeyPressed(KeyMap[KEY_RIGHT])) { selectRight(); return; }
 	if (Shift && ImGui::IsKeyPressed(KeyMap[KEY_LEFT])) { selectLeft(); return; }
 	if (Shift && ImGui::IsKeyPressed(KeyMap[KEY_DOWN])) { selectDown(); return; }
 	if (Shift && ImGui::IsKeyPressed(KeyMap[KEY_UP])) { selectUp(); return; }
-	if (Shift && ImGui::IsKeyPressed(KeyMap[KEY_TAB])) { outdent(); return; }
+	if (edit && Shift && ImGui::IsKeyPressed(KeyMap[KEY_TAB])) { outdent(); return; }
 
 	if (Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_RIGHT])) { boundaryRight(); return; }
 	if (Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_LEFT])) { boundaryLeft(); return; }
-	if (Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_DOWN])) { bumpdown(); return; }
-	if (Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_UP])) { bumpup(); return; }
-	if (Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_Z])) { undo(); return; }
-	if (Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_Y])) { redo(); return; }
-	if (Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_X])) { cut(); return; }
+	if (edit && Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_DOWN])) { bumpdown(); return; }
+	if (edit && Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_UP])) { bumpup(); return; }
+	if (edit && Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_Z])) { undo(); return; }
+	if (edit && Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_Y])) { redo(); return; }
+	if (edit && Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_X])) { cut(); return; }
 	if (Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_C])) { copy(); return; }
-	if (Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_V])) { paste(); return; }
+	if (edit && Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_V])) { paste(); return; }
 	if (Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_D])) { selectNext(); return; }
 	if (Ctrl && ImGui::IsKeyPressed(KeyMap[KEY_K])) { selectSkip(); return; }
 
 //	if (Ctrl && ImGui::IsKeyReleased(KeyMap[KEY_A])) { selectAll(); return; }
-	if (Ctrl && ImGui::IsKeyReleased(KeyMap[KEY_S])) { save(); return; }
+	if (edit && Ctrl && ImGui::IsKeyReleased(KeyMap[KEY_S])) { save(); return; }
 //	if (Ctrl && ImGui::IsKeyReleased(KeyMap[KEY_L])) { reload(); return; }
 
 	bool mods = io.KeyCtrl || io.KeyShift || io.KeyAlt || io.KeySuper;
 
 	if (ImGui::IsKeyReleased(KeyMap[KEY_ESCAPE])) { single(); sanity(); return; }
 
-	if (!mods && ImGui::IsKeyPressed(KeyMap[KEY_TAB])) { indent(); return; }
-	if (!mods && ImGui::IsKeyPressed(KeyMap[KEY_RETURN])) { insert('\n', true); return; }
+	if (edit && !mods && ImGui::IsKeyPressed(KeyMap[KEY_TAB])) { indent(); return; }
+	if (edit && !mods && ImGui::IsKeyPressed(KeyMap[KEY_RETURN])) { insert('\n', true); return; }
 	if (!mods && ImGui::IsKeyPressed(KeyMap[KEY_UP])) { up(); return; }
 	if (!mods && ImGui::IsKeyPressed(KeyMap[KEY_DOWN])) { down(); return; }
 	if (!mods && ImGui::IsKeyPressed(KeyMap[KEY_RIGHT])) { right(); return; }
@@ -1008,8 +1380,8 @@ void View::input() {
 	if (!mods && ImGui::IsKeyPressed(KeyMap[KEY_PAGEUP])) { pgup(); return; }
 	if (!mods && ImGui::IsKeyPressed(KeyMap[KEY_PAGEDOWN])) { pgdown(); return; }
 
-	if (!mods && ImGui::IsKeyPressed(KeyMap[KEY_BACKSPACE])) { back(); return; }
-	if (!mods && ImGui::IsKeyPressed(KeyMap[KEY_DELETE])) { del(); return; }
+	if (edit && !mods && ImGui::IsKeyPressed(KeyMap[KEY_BACKSPACE])) { back(); return; }
+	if (edit && !mods && ImGui::IsKeyPressed(KeyMap[KEY_DELETE])) { del(); return; }
 
 	if (mouseOver && (io.MouseWheel > 0.0f || io.MouseWheel < 0.0f)) {
 		auto now = std::chrono::system_clock::now();
@@ -1021,14 +1393,16 @@ void View::input() {
 		return;
 	}
 
-	if (!io.KeyCtrl && !io.KeyAlt && !io.KeySuper) {
+	if (edit && !io.KeyCtrl && !io.KeyAlt && !io.KeySuper && io.InputQueueCharacters.Size) {
+		// a frame's typing is one transaction
+		begin();
 		for (auto c: io.InputQueueCharacters) insert(c);
+		commit();
 		io.ClearInputCharacters();
 	}
 }
 
 void View::autosyntax() {
-	delete syntax;
 	syntax = nullptr;
 
 	auto fpath = std::filesystem::weakly_canonical(path);
@@ -1043,58 +1417,58 @@ void View::autosyntax() {
 	};
 
 	if ((std::set<std::string>{".cc", ".cpp", ".cxx", ".c", ".h", ".hpp", ".fs", ".vs", ".ct", ".json", ".php", ".glsl"}).count(ext)) {
-		syntax = new CPP();
+		syntax = std::make_shared<CPP>();
 	}
 	else
 	if ((std::set<std::string>{".scad"}).count(ext)) {
-		syntax = new OpenSCAD();
+		syntax = std::make_shared<OpenSCAD>();
 	}
 	else
 	if ((std::set<std::string>{".js"}).count(ext)) {
-		syntax = new JavaScript();
+		syntax = std::make_shared<JavaScript>();
 	}
 	else
 	if ((std::set<std::string>{".sh"}).count(ext)) {
-		syntax = new Bash();
+		syntax = std::make_shared<Bash>();
 	}
 	else
 	if ((std::set<std::string>{".ini"}).count(ext)) {
-		syntax = new INI();
+		syntax = std::make_shared<INI>();
 	}
 	else
 	if ((std::set<std::string>{".yaml",".yml"}).count(ext)) {
-		syntax = new YAML();
+		syntax = std::make_shared<YAML>();
 	}
 	else
 	if ((std::set<std::string>{".xml", ".html"}).count(ext)) {
-		syntax = new XML();
+		syntax = std::make_shared<XML>();
 	}
 	else
 	if ((std::set<std::string>{".f", ".4th"}).count(ext)) {
-		syntax = new Forth();
+		syntax = std::make_shared<Forth>();
 	}
 	else
 	if ((std::set<std::string>{".rela", ".lua"}).count(ext)) {
-		syntax = new Rela();
+		syntax = std::make_shared<Rela>();
 	}
 	else
 	if ((std::set<std::string>{".hx"}).count(ext)) {
-		syntax = new Haxe();
+		syntax = std::make_shared<Haxe>();
 	}
 	else
 	if (name == "CMakeLists.txt") {
-		syntax = new CMake();
+		syntax = std::make_shared<CMake>();
 	}
 	else
 	if (stem == "Makefile") {
-		syntax = new Make();
+		syntax = std::make_shared<Make>();
 	}
 	else
 	if (stem.find("Dockerfile") != std::string::npos) {
-		syntax = new Docker();
+		syntax = std::make_shared<Docker>();
 	}
 	else {
-		syntax = new PlainText();
+		syntax = std::make_shared<PlainText>();
 	}
 }
 
@@ -1102,23 +1476,27 @@ bool View::open(std::string path) {
 	notef("open %s", path);
 	auto fpath = std::filesystem::weakly_canonical(path);
 
+	std::error_code ec;
+	auto bytes = std::filesystem::file_size(fpath, ec);
+	if (!ec && bytes >= config.view.large && openLarge(fpath.string())) return true;
+
 	// figure out why wifstream doesn't work
 	auto in = std::ifstream(fpath.string());
 	if (!in) return false;
 
 	this->path = fpath.string();
 
+	indexing.reset();
+	large.reset();
 	text.clear();
 	selections.clear();
 	modified = false;
-	undos.clear();
-	redos.clear();
 
 	std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
 	in.close();
 
 	for (auto& c: content) if (!c) return false;
-	text.push_back(content);
+	text.push_back(std::move(content));
 
 	autosyntax();
 
@@ -1126,119 +1504,386 @@ bool View::open(std::string path) {
 	tabs.hard = tabcfg.first;
 	tabs.width = tabcfg.second;
 
-	orig = deflate(text.exportRaw(), defl);
+	orig = text.hash();
 
 	sanity();
+	forget();
+	restore();
 	return true;
 }
 
-void View::convertTabsSoft() {
-	snap();
-	for (int i = 0; i < (int)text.size(); i++) {
-		if (get(i) == '\t') {
-			ViewRegion region = {i,0};
-			delAt(region);
-			for (int j = 0; j < tabs.width; j++) {
-				insertAt(region, ' ', false);
-			}
+// bytes of a large file shown at once while it indexes
+static const size_t preview = 1<<20;
+
+// Show part of a large file straight from its mapping while a worker
+// indexes the rest. The view is read-only until indexed() adopts the
+// result, and stays mapped until the first edit makes a private copy.
+bool View::openLarge(const std::string& fpath) {
+	auto file = std::make_shared<const Doc::Mapping>(fpath);
+	if (!file->data) return false;
+	if (memchr(file->data, 0, std::min(preview, file->size))) return false;
+
+	// invalid UTF-8 takes the normal path, which repairs it
+	Doc window;
+	if (!window.map(file, preview)) return false;
+
+	path = fpath;
+	text = std::move(window);
+	selections.clear();
+	modified = false;
+	orig.reset();
+	large = file;
+	windowFrom = 0;
+	windowLine = 0;
+
+	// binary files are only found out here, and come back empty
+	indexing = std::make_shared<channel<std::shared_ptr<Doc>,1>>();
+	crew.start(1);
+	crew.job([file,indexing=indexing]() {
+		if (memchr(file->data, 0, file->size)) {
+			indexing->send(nullptr);
+			return;
 		}
-	}
-	tabs.hard = false;
-	modified = true;
+		auto doc = std::make_shared<Doc>();
+		if (!doc->map(file)) doc->push_back(std::string(file->data, file->size));
+		indexing->send(doc);
+	});
+
+	autosyntax();
+
+	auto tabcfg = syntax->tabs(text);
+	tabs.hard = tabcfg.first;
+	tabs.width = tabcfg.second;
+
 	sanity();
+	forget();
+	return true;
 }
 
-void View::convertTabsHard() {
-	auto indent = [&](int i) {
-		for (int j = 0; i+j < (int)text.size() && j < tabs.width; j++) {
-			if (get(i+j) != ' ') return false;
+// Adopt the indexed text, keeping the place reached in the preview.
+bool View::indexed() {
+	if (!indexing) return true;
+	for (auto& doc: indexing->recv_all()) {
+		indexing.reset();
+		large.reset();
+
+		if (!doc) {
+			notef("binary %s", path);
+			path.clear();
+			text.clear();
+			selections.clear();
+			top = 0;
+			sanity();
+			forget();
+			break;
 		}
-		return true;
-	};
 
-	for (int i = 0; i < (int)text.size(); i++) {
-		if (!i || get(i) == '\n') {
-			i++;
-			while (i < (int)text.size() && indent(i)) {
-				ViewRegion region = {i,0};
-				for (int j = 0; j < tabs.width; j++) {
-					delAt(region);
-				}
-				insertAt(region, '\t', false);
-				i++;
+		auto cursor = text.cursor(selections.front().offset);
+		text = std::move(*doc);
+		orig = text.hash();
+		top += windowLine;
+		int line = std::min((int)cursor.line+windowLine, (int)text.line_count()-1);
+		selections = {{(int)(text.line_offset(line)+cursor.cell), 0}};
+		sanity();
+		forget();
+	}
+	return !indexing;
+}
+
+// Slide the preview window when the view nears either end of it, keeping
+// the top line and cursor in place. Windows start on a line and each
+// move is bounded by the window size, so windowLine stays exact.
+void View::follow() {
+	if (!indexing || !large) return;
+
+	int margin = std::max(h, 50)*2;
+	int lines = text.line_count();
+	bool nearEnd = top+margin > lines && windowFrom+preview < large->size;
+	bool nearStart = top < margin && windowFrom > 0;
+	if (!nearEnd && !nearStart) return;
+
+	// byte offset of the top line
+	auto data = large->data;
+	size_t at = windowFrom;
+	int skipped = 0;
+	for (; skipped < top; skipped++) {
+		auto nl = (const char*)memchr(data+at, '\n', large->size-at);
+		if (!nl) break;
+		at = nl-data+1;
+	}
+
+	// center the window on it, from the next line start
+	size_t from = at > preview/2 ? at-preview/2: 0;
+	if (from) {
+		auto nl = (const char*)memchr(data+from-1, '\n', at-from+1);
+		from = nl ? nl-data+1: at;
+	}
+	if (from == windowFrom) return;
+
+	int above = 0;
+	for (size_t i = from; i < at; i++) above += data[i] == '\n';
+
+	Doc window;
+	if (!window.map(large, preview, from)) return;
+
+	auto cursor = text.cursor(selections.front().offset);
+	int shift = skipped-above;
+
+	text = std::move(window);
+	windowFrom = from;
+	windowLine += shift;
+	top = above;
+	int line = std::max(0, std::min((int)cursor.line-shift, (int)text.line_count()-1));
+	int cell = std::min((int)cursor.cell, toEol(text.line_offset(line)));
+	selections = {{(int)text.line_offset(line)+cell, 0}};
+	sanity();
+	forget();
+}
+
+// A line rewritten by transform(), reduced to the cells that differ
+struct Rewrite {
+	int line = 0;
+	int offset = 0;
+	int column = 0;
+	int removed = 0;
+	int inserted = 0;
+	std::string text;
+};
+
+static int cells(const char* bytes, size_t length) {
+	int n = 0;
+	for (size_t i = 0; i < length; i++) n += ((uint8_t)bytes[i] & 0xc0) != 0x80;
+	return n;
+}
+
+static bool continues(const std::string& s, size_t i) {
+	return i < s.size() && ((uint8_t)s[i] & 0xc0) == 0x80;
+}
+
+bool View::transform(int first, int last, const std::function<void(int line, int offset, std::string& text)>& fn) {
+	return transform({{first, last}}, fn);
+}
+
+// Lines in the ranges, each first..last and in order, are rewritten in
+// chunks on the mappers pool, each job reading its own snapshot, and the
+// differences are patched in at once. fn gets a line's number, its offset
+// and its text without the newline, and must not add or remove newlines.
+// Selections keep their line and column, shifted past rewritten runs and
+// clamped within them.
+bool View::transform(const std::vector<std::pair<int,int>>& ranges, const std::function<void(int line, int offset, std::string& text)>& fn) {
+	int count = text.line_count();
+	int lines = 0;
+	for (auto [first, last]: ranges) lines += std::max(0, std::min(last, count-1)-first+1);
+	if (!lines) return false;
+
+	int threads = std::max(1u, std::thread::hardware_concurrency());
+	int chunks = std::clamp(lines/1024, 1, threads);
+	std::vector<std::vector<Rewrite>> results(chunks);
+
+	auto rewrite = [&](int chunk, const Doc& doc, int from, int to) {
+		int offset = doc.line_offset(from);
+		auto in = doc.read(offset);
+		char bytes[4];
+		for (int line = from; line < to; line++) {
+			std::string before;
+			int length = 0;
+			while (!in.done()) {
+				auto c = in.next();
+				if (c == '\n') break;
+				before.append(bytes, UTF8::encode(c, bytes));
+				length++;
 			}
-			i--;
+			std::string after = before;
+			fn(line, offset, after);
+			if (after != before) {
+				size_t head = 0, tail = 0;
+				while (head < before.size() && head < after.size() && before[head] == after[head]) head++;
+				while (head && (continues(before, head) || continues(after, head))) head--;
+				while (tail < before.size()-head && tail < after.size()-head && before[before.size()-1-tail] == after[after.size()-1-tail]) tail++;
+				while (tail && continues(before, before.size()-tail)) tail--;
+				int column = cells(before.data(), head);
+				results[chunk].push_back({
+					.line = line,
+					.offset = offset+column,
+					.column = column,
+					.removed = cells(before.data()+head, before.size()-head-tail),
+					.inserted = cells(after.data()+head, after.size()-head-tail),
+					.text = after.substr(head, after.size()-head-tail),
+				});
+			}
+			offset += length+1;
+		}
+	};
+
+	// a chunk takes its share of the lines counted across the ranges
+	auto job = [&](int chunk, std::shared_ptr<const Doc> doc) {
+		int start = (int)((int64_t)lines*chunk/chunks);
+		int stop = (int)((int64_t)lines*(chunk+1)/chunks);
+		int at = 0;
+		for (auto [first, last]: ranges) {
+			int n = std::max(0, std::min(last, count-1)-first+1);
+			int from = first + std::clamp(start-at, 0, n);
+			int to = first + std::clamp(stop-at, 0, n);
+			at += n;
+			if (from < to) rewrite(chunk, *doc, from, to);
+		}
+	};
+
+	if (chunks == 1) {
+		job(0, text.snapshot());
+	}
+	else {
+		mappers.start(threads);
+		for (int chunk = 0; chunk < chunks; chunk++) {
+			mappers.job([&,chunk,doc=text.snapshot()]() { job(chunk, doc); });
 		}
+		mappers.wait();
 	}
+
+	std::vector<Rewrite> rewrites;
+	for (auto& result: results) {
+		std::move(result.begin(), result.end(), std::back_inserter(rewrites));
+	}
+	if (rewrites.empty()) return false;
+
+	std::vector<std::pair<Doc::Cursor,Doc::Cursor>> cursors;
+	for (auto& selection: selections) {
+		cursors.push_back({text.cursor(selection.offset), text.cursor(selection.offset+selection.length)});
+	}
+
+	std::vector<Doc::Patch> patches;
+	for (auto& rewrite: rewrites) {
+		patches.push_back({(uint)rewrite.offset, (uint)rewrite.removed, std::move(rewrite.text)});
+	}
+	text.patch(patches);
+
+	auto remap = [&](Doc::Cursor cursor) {
+		int column = cursor.cell;
+		auto it = std::lower_bound(rewrites.begin(), rewrites.end(), (int)cursor.line, [](auto& rewrite, int line) {
+			return rewrite.line < line;
+		});
+		if (it != rewrites.end() && it->line == (int)cursor.line && column > it->column) {
+			if (column >= it->column+it->removed) column += it->inserted-it->removed;
+			else column = std::min(column, it->column+it->inserted);
+		}
+		return (int)text.line_offset(cursor.line) + column;
+	};
+
+	for (uint i = 0; i < selections.size(); i++) {
+		int start = remap(cursors[i].first);
+		int end = remap(cursors[i].second);
+		selections[i] = {start, std::max(0, end-start)};
+	}
+	return true;
+}
+
+void View::convertTabsSoft() {
+	begin();
+	snap();
+	std::string spaces(tabs.width, ' ');
+	bool changed = transform(0, text.line_count()-1, [&](int, int, std::string& line) {
+		for (size_t i = line.find('\t'); i != std::string::npos; i = line.find('\t', i+spaces.size())) {
+			line.replace(i, 1, spaces);
+		}
+	});
+	tabs.hard = false;
+	if (changed) modified = true;
+	commit();
+}
+
+// each run of tabs.width spaces leading a line becomes a tab
+void View::convertTabsHard() {
+	begin();
+	snap();
+	int width = std::max(1, tabs.width);
+	bool changed = transform(0, text.line_count()-1, [&](int, int, std::string& line) {
+		int runs = (int)std::min(line.find_first_not_of(' '), line.size())/width;
+		if (runs) line.replace(0, runs*width, runs, '\t');
+	});
 	tabs.hard = true;
-	modified = true;
-	sanity();
+	if (changed) modified = true;
+	commit();
 }
 
-void View::convertUpper() {
-	auto state = selections;
-	for (auto& selection: state) {
-		for (int i = 0, l = selection.length; i < l; i++) {
-			ViewRegion region = {selection.offset+i,0};
-			int c = get(region.offset);
-			if (isupper(c)) continue;
-			delAt(region);
-			insertAt(region, upper(c), false);
+// the selected cells of each line they cross
+void View::convertCase(int (View::*change)(int)) {
+	if (selections.empty()) return;
+	begin();
+	snap();
+	int first = text.cursor(selections.front().offset).line;
+	int last = text.cursor(selections.back().offset+selections.back().length).line;
+	bool changed = transform(first, last, [&](int, int offset, std::string& line) {
+		auto it = std::upper_bound(selections.begin(), selections.end(), offset, [](int offset, auto& selection) {
+			return offset < selection.offset+selection.length;
+		});
+		if (it == selections.end() || it->offset >= offset+(int)line.size()) return;
+		auto codes = UTF8(line).codes;
+		int length = codes.size();
+		for (; it != selections.end() && it->offset < offset+length; ++it) {
+			int from = std::max(it->offset-offset, 0);
+			int to = std::min(it->offset+it->length-offset, length);
+			for (int i = from; i < to; i++) codes[i] = (this->*change)(codes[i]);
 		}
-	}
-	selections = state;
-	modified = true;
-	sanity();
+		line.clear();
+		char bytes[4];
+		for (auto c: codes) line.append(bytes, UTF8::encode(c, bytes));
+	});
+	if (changed) modified = true;
+	commit();
+}
+
+void View::convertUpper() {
+	convertCase(&View::upper);
 }
 
 void View::convertLower() {
-	auto state = selections;
-	for (auto& selection: state) {
-		for (int i = 0, l = selection.length; i < l; i++) {
-			ViewRegion region = {selection.offset+i,0};
-			int c = get(region.offset);
-			if (islower(c)) continue;
-			delAt(region);
-			insertAt(region, lower(c), false);
-		}
-	}
-	selections = state;
-	modified = true;
-	sanity();
+	convertCase(&View::lower);
+}
+
+static void trimLine(int, int, std::string& line) {
+	size_t end = line.size();
+	while (end && iswspace((uint8_t)line[end-1])) end--;
+	line.resize(end);
 }
 
 void View::trimTailingWhite() {
-	std::vector<Doc::Cursor> cursors;
-	for (auto& selection: selections) {
-		cursors.push_back(text.cursor(selection.offset));
+	bool changed = transform(0, text.line_count()-1, trimLine);
+	if (changed) modified = true;
+	sanity();
+}
+
+// Trim the lines changed since the last save, so saving costs what was
+// edited rather than the whole buffer. Every line when the journal no
+// longer reaches back that far.
+void View::trimChanged() {
+	if (text.version == trimmed) return;
+	if (!text.recent(trimmed)) {
+		trimTailingWhite();
+		trimmed = text.version;
+		return;
 	}
-	text.cursor(0);
-	for (auto& line: text.lines) {
-		while (line.size() > 1 && iswspace(line[line.size()-2])) {
-			line.erase(line.begin()+line.size()-2);
-			text.count--;
+
+	std::vector<std::pair<int,int>> ranges;
+	for (auto& region: text.regions(trimmed)) {
+		int first = text.cursor(region.offset).line;
+		int last = text.cursor(region.offset+region.length).line;
+		if (ranges.size() && first <= ranges.back().second+1) {
+			ranges.back().second = std::max(ranges.back().second, last);
+			continue;
 		}
+		ranges.push_back({first, last});
 	}
-	for (uint i = 0; i < selections.size(); i++) {
-		auto& cursor = cursors[i];
-		auto& selection = selections[i];
-		selection.offset = text.line_offset(cursor.line) + std::min(cursor.cell, (uint)text.lines[cursor.line].size()-1);
-	}
-	modified = true;
+
+	bool changed = transform(ranges, trimLine);
+	if (changed) modified = true;
 	sanity();
+	trimmed = text.version;
 }
 
 std::vector<ViewRegion> View::search(const std::string& needle) {
 	std::vector<ViewRegion> hits;
-	for (int i = 0, l = text.size(), n = needle.size(); i < l; i++) {
-		int j = 0;
-		bool hit = get(i) == needle[0];
-		for (; hit && j < l && j < n; j++) {
-			hit = hit && (needle[j] == get(i+j));
-		}
-		if (hit && j == n) {
-			hits.push_back({i,n});
-		}
+	for (auto& match: Search(needle).all(text)) {
+		hits.push_back({(int)match.offset, (int)match.length});
 	}
 	return hits;
 }
@@ -1260,14 +1905,85 @@ std::string View::blurb() {
 	return blurbGit.size() ? blurbGit: "(no branch)";
 }
 
-void View::save() {
-	if (!path.size()) return;
-	trimTailingWhite();
-	auto out = std::ofstream(path);
-	out << std::string(text);
-	out.close();
-	modified = false;
-	orig = deflate(text.exportRaw(), defl);
+void View::save(bool background) {
+	// still mapped means unchanged
+	if (!path.size() || text.mapped()) return;
+	// this text is already on its way to disk
+	if (background && saving == text.hash()) return;
+	trimChanged();
+	close();
+	auto hash = text.hash();
+
+	// the whole history, or what changed since the last save
+	auto file = journalPath();
+	if (file.size() && rewrite) {
+		journal.clear();
+		for (auto& change: undos) putJournal(journal, change);
+		for (auto& change: redos) {
+			putJournal(journal, change);
+			journal += 'u';
+			putJournal(journal, change.selections);
+		}
+	}
+	auto records = std::move(journal);
+	bool fresh = rewrite;
+	journal.clear();
+	rewrite = false;
+
+	// the save record goes in only once the file is in place
+	auto log = [file, fresh, records=std::move(records)](const Doc& doc, bool saved) mutable {
+		if (!file.size()) return;
+		if (saved) {
+			records += 's';
+			putJournal(records, doc.hash());
+		}
+		// a partial write would break the file, so start again
+		if (!writeJournal(file, records, fresh)) {
+			std::error_code ec;
+			std::filesystem::remove(file, ec);
+		}
+	};
+
+	if (background) {
+		if (!saves) saves = std::make_shared<channel<Saved,-1>>();
+		saving = hash;
+		writer.start(1);
+		writer.job([doc=text.snapshot(),path=path,sync=config.view.fsync,log=std::move(log),saves=saves,hash]() mutable {
+			bool saved = doc->save(path, sync);
+			if (!saved) notef("save failed: %s", path);
+			log(*doc, saved);
+			saves->send({hash, saved});
+		});
+		return;
+	}
+
+	// an older snapshot still queued must not land after this one
+	writer.wait();
+	saved();
+	bool ok = text.save(path, config.view.fsync);
+	if (ok) orig = hash; else notef("save failed: %s", path);
+	modified = !ok;
+	log(text, ok);
+}
+
+// Adopt finished background saves. The text counts as unmodified only if
+// it has not changed since the snapshot written. True while any are queued.
+bool View::saved() {
+	if (!saves) return false;
+	for (auto& result: saves->recv_all()) {
+		if (saving == result.hash) saving.reset();
+		if (!result.ok) continue;
+		orig = result.hash;
+		modified = text.hash() != result.hash;
+	}
+	return saving.has_value();
+}
+
+// true when the file on disk no longer matches what was opened or saved
+bool View::stale() {
+	if (!path.size() || !orig) return true;
+	Doc::Mapping file(path);
+	return Doc::hash(file.data, file.size) != *orig;
 }
 
 void View::reload() {
@@ -1278,7 +1994,18 @@ void View::reload() {
 	sanity();
 }
 
+// Reload when the file changed on disk and there are no edits to lose.
+// The hash check keeps the history of files that are unchanged; large
+// files are left to an explicit reload rather than rehashed.
+void View::revert() {
+	if (modified || !orig || saving || text.size() >= config.view.large) return;
+	if (!stale()) return;
+	reload();
+}
+
 void View::draw() {
+	if (!indexed()) follow();
+
 	int row = 0;
 	int col = 0;
 	int cursor = 0;
@@ -1315,7 +2042,7 @@ void View::draw() {
 	bool synhint = false;
 	bool selhint = false;
 
-	int lineCol = std::ceil(std::log10((int)text.lines.size()+1));
+	int lineCol = std::ceil(std::log10((int)text.line_count()+1));
 	std::string lineFmt = fmt("%%0%dd ", lineCol);
 	int lineNo = top+1;
 
@@ -1372,12 +2099,21 @@ void View::draw() {
 	cursor = text.line_offset(top);
 	token = syntax->first(text, cursor);
 
+	// Selections are sorted and apart, so their starts and ends are met in
+	// order. Zero length cursors show over one cell.
+	auto next = std::lower_bound(selections.begin(), selections.end(), cursor, [](auto& s, int offset) {
+		return s.offset < offset;
+	});
+	auto ending = std::lower_bound(selections.begin(), selections.end(), cursor, [](auto& s, int offset) {
+		return s.offset+std::max(s.length,1) < offset;
+	});
+
 	// detect large selection starting off screen
-	for (auto& selection: selections) {
-		if (selection.offset < cursor && selection.offset+selection.length >= cursor) {
+	if (next != selections.begin()) {
+		auto& selection = *(next-1);
+		if (selection.offset+selection.length >= cursor) {
 			++selecting;
 			state = Theme::State::Selected;
-			break;
 		}
 	}
 
@@ -1396,15 +2132,13 @@ void View::draw() {
 
 		auto newState = state;
 
-		for (auto& selection: selections) {
-			if (selection.offset == cursor) {
-				++selecting;
-				newState = Theme::State::Selected;
-			}
-			if (selection.offset + std::max(selection.length,1) == cursor) {
-				selecting = std::max(0,selecting-1);
-				if (!selecting) newState = Theme::State::Plain;
-			}
+		for (; ending != selections.end() && ending->offset+std::max(ending->length,1) <= cursor; ++ending) {
+			selecting = std::max(0,selecting-1);
+			if (!selecting) newState = Theme::State::Plain;
+		}
+		for (; next != selections.end() && next->offset <= cursor; ++next) {
+			++selecting;
+			newState = Theme::State::Selected;
 		}
 
 		auto newToken = syntax->next(text, cursor, token);
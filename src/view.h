@@ -9,10 +9,13 @@ struct ViewRegion;
 #include <string>
 #include <cmath>
 #include <chrono>
+#include <optional>
 #include "doc.h"
+#include "words.h"
 #include "syntax.h"
 #include "flate.h"
 #include "repo.h"
+#include "workers.h"
 
 struct ViewRegion {
 	int offset;
@@ -28,16 +31,39 @@ struct View {
 	int h = 0;
 	int top = 0;
 	Doc text;
-	deflation orig;
+	// content hash as last opened or saved
+	std::optional<uint64_t> orig;
 	std::string path;
 	bool modified = false;
 	bool mouseOver = false;
-	Syntax* syntax = nullptr;
+	std::shared_ptr<Syntax> syntax;
 	std::chrono::time_point<std::chrono::system_clock> lastWheel;
 
 	std::chrono::time_point<std::chrono::system_clock> lastGit;
 	std::string blurbGit;
 
+	// Large files are mapped and shown through a read-only preview window
+	// that follows scrolling while a worker indexes the whole mapping
+	static inline workers crew;
+	std::shared_ptr<channel<std::shared_ptr<Doc>,1>> indexing;
+	std::shared_ptr<const Doc::Mapping> large;
+	// byte offset and first line of the preview window in the mapping
+	size_t windowFrom = 0;
+	int windowLine = 0;
+
+	// Background saves write snapshots in order on their own thread and
+	// report back the hash of each, which saved() adopts
+	static inline workers writer;
+
+	struct Saved {
+		uint64_t hash = 0;
+		bool ok = false;
+	};
+
+	std::shared_ptr<channel<Saved,-1>> saves;
+	// the newest snapshot queued for writing
+	std::optional<uint64_t> saving;
+
 	struct {
 		bool hard = true;
 		int width = 4;
@@ -46,31 +72,92 @@ struct View {
 	std::vector<ViewRegion> selections;
 
 	struct Clip {
-		std::vector<uint32_t> text;
+		std::string text;
 		bool line = false;
 	};
 
 	std::vector<Clip> clips;
 
 	ViewRegion skip;
+	// the newest match added by selectNext
+	ViewRegion latest = {-1,-1};
+
+	// matches of the needle last searched for by selection, until the text changes
+	struct {
+		std::string needle;
+		uint64_t version = 0;
+		uint64_t hash = 0;
+		std::vector<ViewRegion> regions;
+	} matches;
+
+	// identifiers in the text for autocomplete, built on first use and then
+	// kept up to date edit by edit
+	Words words;
 
 	enum ChangeType {
 		SnapShot,
 		Navigation,
 	};
 
+	// a region of the text replaced by a change, at its offset before
+	struct Edit {
+		int offset = 0;
+		int removed = 0;
+		int inserted = 0;
+		std::string before;
+		std::string after;
+	};
+
 	struct Change {
 		ChangeType type = SnapShot;
 		std::vector<ViewRegion> selections;
-		deflation text;
+		std::vector<Edit> edits;
 	};
 
-	const int defl = 7;
-
 	std::vector<Change> undos;
 	std::vector<Change> redos;
 
-	uint maxChanges = 10000;
+	// bytes held by undos and redos
+	size_t history = 0;
+
+	// Trimmed history is freed off the UI thread, handed over in batches
+	// by release() once a frame or when a batch grows large
+	static inline workers compactor;
+	std::vector<Change> dropped;
+	size_t droppedBytes = 0;
+
+	// whole-buffer transforms rewrite lines in parallel
+	static inline workers mappers;
+
+	// The newest SnapShot stays open while edits coalesce into it. Doc's
+	// journal is folded into the regions changed since base, which become
+	// edits when the change closes.
+	bool pending = false;
+	std::vector<Doc::Region> regions;
+	std::shared_ptr<const Doc> base;
+	uint64_t tracked = 0;
+
+	// text version as last trimmed for a save; saves only trim the lines
+	// changed since
+	uint64_t trimmed = 0;
+
+	// History changes are also logged as compact records, appended on save
+	// to a journal file per path that open replays if the file still
+	// matches. A rewrite replaces the file with the whole history instead.
+	std::string journal;
+	bool rewrite = true;
+
+	// open begin() calls and whether they have taken their snapshot
+	int transaction = 0;
+	bool snapped = false;
+
+	// Replaces length cells at offset with text. Edits for many cursors are
+	// spliced in as one batch.
+	struct Splice {
+		int offset = 0;
+		int length = 0;
+		std::string text;
+	};
 
 	View();
 	~View();
@@ -78,16 +165,36 @@ struct View {
 	View& operator=(const View& other);
 	bool open(std::string path);
 	bool open(View* other);
+	bool openLarge(const std::string& fpath);
+	bool indexed();
+	void follow();
 	void autosyntax();
-	void save();
+	void save(bool background = false);
+	bool saved();
+	bool stale();
 	void reload();
+	void revert();
+	void forget();
+	std::string journalPath();
+	void restore();
+	static size_t bytes(const Change& change);
+	void discard(std::vector<Change>& changes, size_t count);
+	void compact(size_t limit);
+	void release();
+	void track();
+	void close();
 	void nav();
 	void snap();
+	void begin();
+	void commit();
 	bool insertion();
 	bool deletion();
 	void undo();
 	void redo();
+	void splice(std::vector<Splice> splices);
+	std::string typed(int offset, int c, bool autoindent);
 	void insertAt(ViewRegion selection, int c, bool autoindent);
+	void insertAt(ViewRegion selection, const std::string& s);
 	void insert(int c, bool autoindent = false);
 	bool erase();
 	int upper(int c);
@@ -117,6 +224,8 @@ struct View {
 	void selectLeft();
 	void selectLeftBoundary();
 	bool selectNext();
+	bool selectOccurrences();
+	const std::vector<ViewRegion>& occurrences(const std::string& needle);
 	void selectDown();
 	void selectUp();
 	void selectSkip();
@@ -129,6 +238,9 @@ struct View {
 	void sanity();
 	int toSol(int offset);
 	int toEol(int offset);
+	int lineEnd(int line);
+	int lineAt(int line, int column);
+	void lines(ViewRegion& selection, int n);
 	int get(int offset);
 	bool sol(int offset);
 	bool eol(int offset);
@@ -147,7 +259,11 @@ struct View {
 	void convertTabsHard();
 	void convertLower();
 	void convertUpper();
+	void convertCase(int (View::*change)(int));
+	bool transform(int first, int last, const std::function<void(int line, int offset, std::string& text)>& fn);
+	bool transform(const std::vector<std::pair<int,int>>& ranges, const std::function<void(int line, int offset, std::string& text)>& fn);
 	void trimTailingWhite();
+	void trimChanged();
 	std::vector<ViewRegion> search(const std::string& needle);
 	std::string selected();
 	std::string blurb();
@@ -0,0 +1,178 @@
+#include "words.h"
+#include "utf8.h"
+#include <algorithm>
+#include <cwctype>
+
+using namespace std;
+
+bool Words::name(uint32_t c) {
+	return iswalnum(c) || c == '_';
+}
+
+// add or remove the identifiers wholly within [from,to)
+void Words::count(const Doc& doc, uint from, uint to, int delta) {
+	string word;
+	char bytes[4];
+
+	auto tally = [&]() {
+		if (word.empty()) return;
+		if (delta > 0) {
+			counts[word]++;
+		}
+		else {
+			auto it = counts.find(word);
+			if (it != counts.end() && !--it->second) counts.erase(it);
+		}
+		word.clear();
+	};
+
+	auto in = doc.read(from);
+	for (uint i = from; i < to; i++) {
+		auto c = in.next();
+		if (name(c)) word.append(bytes, UTF8::encode(c, bytes)); else tally();
+	}
+	tally();
+}
+
+void Words::rebuild(const Doc& text) {
+	counts.clear();
+	count(text, 0, text.size(), 1);
+	base = text.snapshot();
+	version = text.version;
+}
+
+void Words::update(const Doc& text) {
+	if (base && version == text.version && base->hash() == text.hash()) return;
+	if (!base || version == text.version || !text.recent(version)) return rebuild(text);
+	patch(text, text.regions(version));
+}
+
+// recount the regions of text changed since base
+void Words::patch(const Doc& text, const vector<Doc::Region>& regions) {
+	// Each region changed since base widens over the unchanged identifier
+	// characters either side, which sit at the same distance from it in
+	// base. Regions whose widened spans meet are recounted together.
+	uint from = 0, to = 0;
+	uint before = 0, after = 0;
+	bool open = false;
+	int64_t shift = 0;
+
+	auto recount = [&]() {
+		count(*base, before, after, -1);
+		count(text, from, to, 1);
+	};
+
+	for (auto& region: regions) {
+		uint start = region.offset;
+		uint end = region.offset+region.length;
+		while (start > 0 && name(text[start-1])) start--;
+		while (end < text.size() && name(text[end])) end++;
+
+		uint old = region.offset-shift;
+		shift += (int64_t)region.length-region.removed;
+
+		if (open && start <= to) {
+			to = end;
+			after = old+region.removed+(end-region.offset-region.length);
+			continue;
+		}
+
+		if (open) recount();
+		open = true;
+		from = start;
+		to = end;
+		before = old-(region.offset-start);
+		after = old+region.removed+(end-region.offset-region.length);
+	}
+
+	if (open) recount();
+
+	base = text.snapshot();
+	version = text.version;
+}
+
+vector<string> Words::complete(string_view prefix) const {
+	vector<string> hits;
+	for (auto it = counts.upper_bound(prefix); it != counts.end() && it->first.starts_with(prefix); ++it) {
+		hits.push_back(it->first);
+	}
+	return hits;
+}
+
+bool Lexicon::fresh(const string& file, int64_t stamp) const {
+	lock_guard<mutex> lock(sync);
+	auto it = files.find(file);
+	return it != files.end() && (it->second.pinned || it->second.stamp == stamp);
+}
+
+void Lexicon::release(Postings& postings) {
+	for (auto [id, count]: postings.words) totals[id] -= count;
+	postings.words.clear();
+}
+
+void Lexicon::replace(Postings& postings, const map<string, uint, less<>>& counts) {
+	release(postings);
+	postings.words.reserve(counts.size());
+	for (auto& [word, count]: counts) {
+		auto [it, added] = ids.try_emplace(word, totals.size());
+		if (added) totals.push_back(0);
+		totals[it->second] += count;
+		postings.words.push_back({it->second, count});
+	}
+	sort(postings.words.begin(), postings.words.end());
+	postings.words.shrink_to_fit();
+}
+
+void Lexicon::assign(const string& file, const map<string, uint, less<>>& counts, int64_t stamp) {
+	lock_guard<mutex> lock(sync);
+	auto& postings = files[file];
+	if (postings.pinned) return;
+	replace(postings, counts);
+	postings.stamp = stamp;
+}
+
+void Lexicon::pin(const string& file, const map<string, uint, less<>>& counts) {
+	lock_guard<mutex> lock(sync);
+	auto& postings = files[file];
+	replace(postings, counts);
+	postings.pinned = true;
+}
+
+void Lexicon::unpin(const string& file) {
+	lock_guard<mutex> lock(sync);
+	auto it = files.find(file);
+	if (it == files.end()) return;
+	it->second.pinned = false;
+	it->second.stamp = -1;
+}
+
+void Lexicon::retain(const set<string>& keep) {
+	lock_guard<mutex> lock(sync);
+	for (auto it = files.begin(); it != files.end(); ) {
+		if (it->second.pinned || keep.count(it->first)) { ++it; continue; }
+		release(it->second);
+		it = files.erase(it);
+	}
+}
+
+// Interned words stay for the life of the lexicon, and those no file
+// holds any more are skipped by their zero totals.
+vector<string> Lexicon::complete(string_view prefix, size_t limit) const {
+	lock_guard<mutex> lock(sync);
+
+	vector<pair<uint,const string*>> hits;
+	for (auto it = ids.upper_bound(prefix); it != ids.end() && it->first.starts_with(prefix); ++it) {
+		if (totals[it->second]) hits.push_back({totals[it->second], &it->first});
+	}
+
+	// most frequent first, ties in order
+	auto rank = [](auto& a, auto& b) {
+		return a.first != b.first ? a.first > b.first: *a.second < *b.second;
+	};
+	limit = min(limit, hits.size());
+	partial_sort(hits.begin(), hits.begin()+limit, hits.end(), rank);
+
+	vector<string> results;
+	for (size_t i = 0; i < limit; i++) results.push_back(*hits[i].second);
+	return results;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "doc.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+
+// The identifiers in a Doc and how often each occurs, kept in order so
+// that completing a prefix is a range lookup.
+//
+// The index keeps a snapshot of the text it last counted. Updating takes
+// the regions changed since from Doc's journal, widens each over the
+// identifiers it touches, and recounts only those: the old words from the
+// snapshot and the new ones from the text. A journal that no longer
+// reaches back to the snapshot means a full recount. patch() applies
+// regions taken from a text's journal to a snapshot of it, whose own
+// journal starts empty.
+
+struct Words {
+	std::map<std::string, uint, std::less<>> counts;
+	std::shared_ptr<const Doc> base;
+	uint64_t version = 0;
+
+	// identifier characters, as Syntax::isname
+	static bool name(uint32_t c);
+
+	// catch up with the text
+	void update(const Doc& text);
+
+	// indexed identifiers longer than prefix that start with it, in order
+	std::vector<std::string> complete(std::string_view prefix) const;
+
+	// internals
+	void rebuild(const Doc& text);
+	void patch(const Doc& text, const std::vector<Doc::Region>& regions);
+	void count(const Doc& doc, uint from, uint to, int delta);
+};
+
+// Identifiers across many files, ranked by how often they occur overall.
+//
+// Each distinct word is interned once with an id, and each file holds a
+// posting list of the ids it contains with their counts, so replacing a
+// file adjusts the totals by its old and new lists alone. Files read from
+// disk carry a stamp to skip them while unchanged. Words from an open
+// view are pinned over the file's disk words until it closes.
+//
+// Safe to share between indexing workers and the UI thread.
+
+struct Lexicon {
+	struct Postings {
+		int64_t stamp = -1;
+		bool pinned = false;
+		std::vector<std::pair<uint,uint>> words;
+	};
+
+	mutable std::mutex sync;
+	std::map<std::string, uint, std::less<>> ids;
+	std::vector<uint> totals;
+	std::map<std::string, Postings, std::less<>> files;
+
+	// true when a file need not be read again
+	bool fresh(const std::string& file, int64_t stamp) const;
+
+	// a file's words as read from disk, ignored while it is pinned
+	void assign(const std::string& file, const std::map<std::string, uint, std::less<>>& counts, int64_t stamp);
+
+	// an open view's words, until unpinned
+	void pin(const std::string& file, const std::map<std::string, uint, std::less<>>& counts);
+
+	// leave the file to be read from disk again
+	void unpin(const std::string& file);
+
+	// forget unpinned files not in the set
+	void retain(const std::set<std::string>& keep);
+
+	// up to limit words longer than prefix that start with it, most frequent first
+	std::vector<std::string> complete(std::string_view prefix, size_t limit) const;
+
+	// internals
+	void replace(Postings& postings, const std::map<std::string, uint, std::less<>>& counts);
+	void release(Postings& postings);
+};